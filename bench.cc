@@ -0,0 +1,413 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bplus_tree.h"
+
+// YCSB-style workloads over a BPlusTree, one result line per workload in CSV
+// or JSON. See Usage() for the flags.
+
+struct Config {
+  std::string workloads = "ABCDEF";
+  std::string distribution = "zipfian";
+  size_t records = 1000000;
+  size_t ops = 1000000;
+  size_t warmup = 100000;
+  size_t key_size = 24;
+  size_t value_size = 100;
+  size_t max_scan = 100;
+  int threads = 1;
+  bool json = false;
+  std::string path = "bench.db";
+  BPlusTree::Options options;
+};
+
+void Usage() {
+  std::cerr
+      << "Usage: bench [flags]\n"
+         "  --workloads=ABCDEF  YCSB workloads to run in order:\n"
+         "                      A 50% read 50% update, B 95% read 5% update,\n"
+         "                      C read only, D 95% read latest 5% insert,\n"
+         "                      E 95% scan 5% insert, F 50% read 50%\n"
+         "                      read-modify-write\n"
+         "  --distribution=zipfian|uniform|latest\n"
+         "  --records=N         records loaded before the workloads\n"
+         "  --ops=N             timed operations per workload\n"
+         "  --warmup=N          untimed operations before each workload\n"
+         "  --key_size=N        17 to 256 bytes\n"
+         "  --value_size=N --max_scan=N\n"
+         "  --threads=N\n"
+         "  --cache_size=BYTES\n"
+         "  --format=csv|json\n"
+         "  --path=FILE         db file, removed before the run\n"
+         "  --wal --arena --buffered --io_uring --lru --sparse\n"
+         "  --compress          encoded leaves, implies --buffered\n";
+}
+
+bool ParseFlag(const char* arg, Config* config) {
+  std::string flag(arg), value;
+  size_t eq = flag.find('=');
+  if (eq != std::string::npos) {
+    value = flag.substr(eq + 1);
+    flag.resize(eq);
+  }
+  auto number = [&] { return std::stoull(value); };
+  if (flag == "--workloads") {
+    config->workloads = value;
+  } else if (flag == "--distribution") {
+    if (value != "zipfian" && value != "uniform" && value != "latest") {
+      return false;
+    }
+    config->distribution = value;
+  } else if (flag == "--records") {
+    config->records = number();
+  } else if (flag == "--ops") {
+    config->ops = number();
+  } else if (flag == "--warmup") {
+    config->warmup = number();
+  } else if (flag == "--key_size") {
+    config->key_size = number();
+  } else if (flag == "--value_size") {
+    config->value_size = number();
+  } else if (flag == "--max_scan") {
+    config->max_scan = std::max<size_t>(number(), 1);
+  } else if (flag == "--threads") {
+    config->threads = std::max<int>(number(), 1);
+  } else if (flag == "--cache_size") {
+    config->options.cache_size = number();
+  } else if (flag == "--format") {
+    if (value != "csv" && value != "json") return false;
+    config->json = value == "json";
+  } else if (flag == "--path") {
+    config->path = value;
+  } else if (flag == "--wal") {
+    config->options.use_wal = true;
+    config->options.sync_policy = BPlusTree::SyncPolicy::kInterval;
+  } else if (flag == "--arena") {
+    config->options.storage_mode = BPlusTree::StorageMode::kArena;
+  } else if (flag == "--buffered") {
+    config->options.storage_mode = BPlusTree::StorageMode::kBuffered;
+  } else if (flag == "--io_uring") {
+    config->options.storage_mode = BPlusTree::StorageMode::kBuffered;
+    config->options.use_io_uring = true;
+  } else if (flag == "--lru") {
+    config->options.cache_policy = BPlusTree::CachePolicy::kLru;
+  } else if (flag == "--sparse") {
+    config->options.sparse_leaves = true;
+  } else if (flag == "--compress") {
+    config->options.storage_mode = BPlusTree::StorageMode::kBuffered;
+    config->options.compress_leaves = true;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// "k" and 16 hex digits, Key() pads them to key_size.
+const size_t kMinKeySize = 17;
+
+// Key of record i, spread over the key space so that loading and inserting
+// in record order does not append to the last leaf.
+std::string Key(uint64_t i, size_t key_size) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int b = 0; b < 8; ++b, i >>= 8) h = (h ^ (i & 0xff)) * 0x100000001b3ULL;
+  char buf[20];
+  snprintf(buf, sizeof(buf), "k%016llx", (unsigned long long)h);
+  std::string key(buf);
+  key.resize(key_size, 'x');
+  return key;
+}
+
+std::string Value(uint64_t seed, size_t value_size) {
+  std::string value(value_size, 'v');
+  for (size_t i = 0; i < value_size; i += 8) value[i] = 'a' + (seed + i) % 26;
+  return value;
+}
+
+// Zipfian ranks in [0, n) with rank 0 the most popular, as in YCSB. n may
+// grow, zeta is extended incrementally.
+class Zipfian {
+ public:
+  explicit Zipfian(uint64_t n, double theta = 0.99)
+      : n_(0), theta_(theta), zeta_(0), zeta2_(Zeta(0, 2, 0)) {
+    Grow(n);
+  }
+
+  void Grow(uint64_t n) {
+    if (n <= n_) return;
+    zeta_ = Zeta(n_, n, zeta_);
+    n_ = n;
+    alpha_ = 1 / (1 - theta_);
+    eta_ = (1 - std::pow(2.0 / n_, 1 - theta_)) / (1 - zeta2_ / zeta_);
+  }
+
+  uint64_t Next(double u) const {
+    double uz = u * zeta_;
+    if (uz < 1) return 0;
+    if (uz < 1 + std::pow(0.5, theta_)) return 1;
+    uint64_t rank = n_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+    return std::min(rank, n_ - 1);
+  }
+
+ private:
+  double Zeta(uint64_t from, uint64_t to, double sum) const {
+    for (uint64_t i = from; i < to; ++i) sum += 1 / std::pow(i + 1, theta_);
+    return sum;
+  }
+
+  uint64_t n_;
+  double theta_;
+  double zeta_;
+  double zeta2_;
+  double alpha_;
+  double eta_;
+};
+
+// Latencies of one thread in nanoseconds.
+using Latencies = std::vector<uint64_t>;
+
+struct Result {
+  double ops_per_sec;
+  double p50_us, p99_us, p999_us;
+};
+
+class Workload {
+ public:
+  Workload(char name, const Config& config, BPlusTree* tree,
+           std::atomic<uint64_t>* inserted)
+      : name_(name),
+        config_(config),
+        tree_(tree),
+        inserted_(inserted),
+        zipfian_(config.records) {
+    // Percent of reads, updates, inserts, scans and read-modify-writes.
+    static const struct {
+      char name;
+      int mix[5];
+    } kMixes[] = {{'A', {50, 50, 0, 0, 0}}, {'B', {95, 5, 0, 0, 0}},
+                  {'C', {100, 0, 0, 0, 0}}, {'D', {95, 0, 5, 0, 0}},
+                  {'E', {0, 0, 5, 95, 0}},  {'F', {50, 0, 0, 0, 50}}};
+    for (const auto& m : kMixes) {
+      if (m.name != name) continue;
+      read_ = m.mix[0];
+      update_ = m.mix[1];
+      insert_ = m.mix[2];
+      scan_ = m.mix[3];
+      rmw_ = m.mix[4];
+    }
+  }
+
+  bool Valid() const { return read_ + update_ + insert_ + scan_ + rmw_ == 100; }
+
+  // Run ops operations over the configured threads, recording latencies if
+  // latencies is not null.
+  double Run(size_t ops, std::vector<Latencies>* latencies) {
+    // Insert-heavy runs draw from a key space that keeps growing, size the
+    // zipfian generator for all of it up front.
+    zipfian_.Grow(inserted_->load() + ops * insert_ / 100 + 1);
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < config_.threads; ++t) {
+      workers.emplace_back([=, this] {
+        std::mt19937_64 rng(t * 7919 + name_);
+        Latencies* lat = latencies == nullptr ? nullptr : &(*latencies)[t];
+        size_t n = ops / config_.threads + (t < int(ops % config_.threads));
+        for (size_t i = 0; i < n; ++i) {
+          auto start = std::chrono::steady_clock::now();
+          Op(rng);
+          if (lat != nullptr) {
+            lat->push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+          }
+        }
+      });
+    }
+    for (auto& worker : workers) worker.join();
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t2 - t1).count();
+  }
+
+ private:
+  // Index of an existing record to touch.
+  uint64_t NextIndex(std::mt19937_64& rng) {
+    uint64_t n = inserted_->load(std::memory_order_relaxed);
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    if (config_.distribution == "uniform") {
+      return std::min<uint64_t>(u * n, n - 1);
+    }
+    uint64_t rank = zipfian_.Next(u) % n;
+    // Latest favours the records inserted last, zipfian scatters the popular
+    // ranks over the key space.
+    if (config_.distribution == "latest" || name_ == 'D') return n - 1 - rank;
+    return rank * 0x9E3779B97F4A7C15ULL % n;
+  }
+
+  void Op(std::mt19937_64& rng) {
+    int dice = rng() % 100;
+    std::string value;
+    if (dice < read_) {
+      tree_->Get(Key(NextIndex(rng), config_.key_size), value);
+    } else if ((dice -= read_) < update_) {
+      uint64_t i = NextIndex(rng);
+      tree_->Put(Key(i, config_.key_size), Value(rng(), config_.value_size));
+    } else if ((dice -= update_) < insert_) {
+      uint64_t i = inserted_->fetch_add(1);
+      tree_->Put(Key(i, config_.key_size), Value(i, config_.value_size));
+    } else if ((dice -= insert_) < scan_) {
+      BPlusTree::Cursor cursor(*tree_);
+      size_t length = rng() % config_.max_scan + 1;
+      for (cursor.Seek(Key(NextIndex(rng), config_.key_size));
+           cursor.Valid() && length-- > 0; cursor.Next()) {
+        value.assign(cursor.Value());
+      }
+    } else {
+      std::string key = Key(NextIndex(rng), config_.key_size);
+      tree_->Get(key, value);
+      tree_->Put(key, Value(rng(), config_.value_size));
+    }
+  }
+
+  char name_;
+  const Config& config_;
+  BPlusTree* tree_;
+  std::atomic<uint64_t>* inserted_;
+  Zipfian zipfian_;
+  int read_ = 0, update_ = 0, insert_ = 0, scan_ = 0, rmw_ = 0;
+};
+
+double Percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = std::min<size_t>(sorted.size() * p, sorted.size() - 1);
+  return sorted[i] / 1000.0;
+}
+
+void Report(const Config& config, const std::string& workload,
+            size_t ops, const Result& r) {
+  const BPlusTree::Options& o = config.options;
+  const char* storage = "blockmap";
+  if (o.storage_mode == BPlusTree::StorageMode::kArena) {
+    storage = "arena";
+  } else if (o.storage_mode == BPlusTree::StorageMode::kBuffered) {
+    storage = o.use_io_uring ? "io_uring" : "buffered";
+  }
+  if (config.json) {
+    printf(
+        "{\"workload\":\"%s\",\"distribution\":\"%s\",\"threads\":%d,"
+        "\"records\":%zu,\"ops\":%zu,\"key_size\":%zu,\"value_size\":%zu,"
+        "\"cache_size\":%zu,\"storage\":\"%s\",\"wal\":%s,"
+        "\"ops_per_sec\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+        "\"p999_us\":%.2f}\n",
+        workload.c_str(), config.distribution.c_str(), config.threads,
+        config.records, ops, config.key_size, config.value_size, o.cache_size,
+        storage, o.use_wal ? "true" : "false", r.ops_per_sec, r.p50_us,
+        r.p99_us, r.p999_us);
+  } else {
+    printf("%s,%s,%d,%zu,%zu,%zu,%zu,%zu,%s,%d,%.0f,%.2f,%.2f,%.2f\n",
+           workload.c_str(), config.distribution.c_str(), config.threads,
+           config.records, ops, config.key_size, config.value_size,
+           o.cache_size, storage, o.use_wal, r.ops_per_sec, r.p50_us, r.p99_us,
+           r.p999_us);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char const* argv[]) {
+  Config config;
+  for (int i = 1; i < argc; ++i) {
+    bool ok;
+    try {
+      ok = ParseFlag(argv[i], &config);
+    } catch (const std::exception&) {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Bad flag " << argv[i] << "\n";
+      Usage();
+      return 1;
+    }
+  }
+  if (config.records == 0) config.records = 1;
+  if (config.key_size < kMinKeySize ||
+      config.key_size > BPlusTree::kMaxKeySize) {
+    std::cerr << "--key_size must be from " << kMinKeySize << " to "
+              << BPlusTree::kMaxKeySize << "\n";
+    return 1;
+  }
+
+  unlink(config.path.c_str());
+  for (int seq = 0; unlink((config.path + ".wal." + std::to_string(seq))
+                               .c_str()) == 0;
+       ++seq) {
+  }
+  BPlusTree tree(config.path.c_str(), config.options);
+  // A record too large for a leaf would turn every Put into a no-op.
+  if (!tree.Put(Key(0, config.key_size), Value(0, config.value_size))) {
+    std::cerr << "Records of --key_size=" << config.key_size
+              << " --value_size=" << config.value_size
+              << " do not fit in a leaf\n";
+    return 1;
+  }
+  if (!config.json) {
+    printf(
+        "workload,distribution,threads,records,ops,key_size,value_size,"
+        "cache_size,storage,wal,ops_per_sec,p50_us,p99_us,p999_us\n");
+  }
+
+  // Load the records in parallel, timed as a workload of its own.
+  std::atomic<uint64_t> next(0);
+  std::vector<Latencies> latencies(config.threads);
+  auto t1 = std::chrono::steady_clock::now();
+  std::vector<std::thread> loaders;
+  for (int t = 0; t < config.threads; ++t) {
+    loaders.emplace_back([&, t] {
+      for (uint64_t i; (i = next.fetch_add(1)) < config.records;) {
+        auto start = std::chrono::steady_clock::now();
+        tree.Put(Key(i, config.key_size), Value(i, config.value_size));
+        latencies[t].push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+      }
+    });
+  }
+  for (auto& loader : loaders) loader.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - t1)
+                       .count();
+  auto summarize = [&](size_t ops, double seconds) {
+    std::vector<uint64_t> all;
+    for (Latencies& lat : latencies) {
+      all.insert(all.end(), lat.begin(), lat.end());
+      lat.clear();
+    }
+    std::sort(all.begin(), all.end());
+    return Result{ops / std::max(seconds, 1e-9), Percentile(all, 0.5),
+                  Percentile(all, 0.99), Percentile(all, 0.999)};
+  };
+  Report(config, "load", config.records, summarize(config.records, seconds));
+
+  std::atomic<uint64_t> inserted(config.records);
+  for (char name : config.workloads) {
+    Workload workload(name, config, &tree, &inserted);
+    if (!workload.Valid()) {
+      std::cerr << "Unknown workload " << name << "\n";
+      return 1;
+    }
+    workload.Run(config.warmup, nullptr);
+    for (Latencies& lat : latencies) lat.reserve(config.ops / config.threads + 1);
+    seconds = workload.Run(config.ops, &latencies);
+    Report(config, std::string(1, name), config.ops,
+           summarize(config.ops, seconds));
+  }
+  return 0;
+}
@@ -2,23 +2,66 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 
+// Nodes are whole pages and start on a page boundary, the meta block takes
+// the first page. Build with -DBPLUS_TREE_PAGE_SIZE=16384 or 65536 for larger
+// pages, a file only opens with the page size it was created with.
+#ifndef BPLUS_TREE_PAGE_SIZE
+#define BPLUS_TREE_PAGE_SIZE 4096
+#endif
+const size_t kPageSize = BPLUS_TREE_PAGE_SIZE;
 const off_t kMetaOffset = 0;
-const int kOrder = 128;
-static_assert(kOrder >= 3,
-              "The order of B+Tree should be greater than or equal to 3.");
-const int kMaxKeySize = 32;
-const int kMaxValueSize = 256;
-const int kMaxCacheSize = 1024 *  1024 * 5;
-typedef char Key[kMaxKeySize];
-typedef char Value[kMaxValueSize];
+const size_t kLeafNodeSize = std::min<size_t>(kPageSize * 4, 1024 * 64);
+const size_t kIndexNodeSize = kPageSize;
+// Only leaves that span several pages can be stored in fewer, see
+// Options::compress_leaves.
+const bool kEncodeLeaves = kLeafNodeSize > kIndexNodeSize;
+static_assert(kPageSize >= 4096 && kPageSize <= 1024 * 64 &&
+                  (kPageSize & (kPageSize - 1)) == 0,
+              "Page size should be a power of two from 4 KB to 64 KB.");
+const int kCacheShardBits = 4;
+const size_t kCacheShards = 1 << kCacheShardBits;
+const size_t kArenaReserveSize = 1UL << 40;
+const off_t kArenaExtentSize = 1024 * 1024 * 16;
+const size_t kTraceEvents = 4096;
+const unsigned kRingEntries = 64;
+const size_t kCacheLineSize = 64;
+const size_t kPrefetchLines = 4;
+
+// Time the rest of the scope as phase, see BPlusTree::Phase.
+#ifdef BPLUS_TREE_TRACE
+#define TRACE_CONCAT(a, b) a##b
+#define TRACE_NAME(line) TRACE_CONCAT(trace_scope_, line)
+#define TRACE_SCOPE(tracer, phase) \
+  Tracer::Scope TRACE_NAME(__LINE__)((tracer), BPlusTree::Phase::phase)
+#define TRACE_EVENT(tracer, type, level, offset) \
+  (tracer)->Event(TraceEvent::type, (level), (offset))
+#else
+#define TRACE_SCOPE(tracer, phase)
+#define TRACE_EVENT(tracer, type, level, offset)
+#endif
 
 void Exit(const char* msg) {
   perror(msg);
@@ -26,626 +69,3794 @@ void Exit(const char* msg) {
 }
 
 struct BPlusTree::Meta {
-  off_t offset;   // ofset of self
-  off_t root;     // offset of root
-  off_t block;    // offset of next new node
-  size_t height;  // height of B+Tree
-  size_t size;    // key size
+  off_t offset;                // ofset of self
+  std::atomic<off_t> root;     // offset of root
+  off_t block;                 // offset of next new node
+  std::atomic<size_t> height;  // height of B+Tree
+  std::atomic<size_t> size;    // key size
+  off_t free_list[2];  // heads of saved free block chains per size class
+  uint64_t wal_seq;    // first log segment needed to recover
+  uint32_t page_size;  // kPageSize the file was created with
+  uint32_t encoded_leaves;  // leaves may be encoded, see compress_leaves
+  size_t blocks[2];    // blocks handed out from the end per size class
+  std::atomic<size_t> record_bytes;  // LeafNode::RecordSize() of all records
 };
 
-struct BPlusTree::Index {
-  Index() : offset(0) { std::memset(key, 0, sizeof(key)); }
+// Every node carries an optimistic latch. Readers remember the version, read
+// without locking and restart if it changed meanwhile. Writers lock it, and
+// unlocking bumps the version.
+struct BPlusTree::Node {
+  static constexpr uint64_t kObsolete = 1;  // deallocated
+  static constexpr uint64_t kLocked = 2;
 
-  off_t offset;
-  Key key;
+  // version is left alone, so that a reused block keeps counting up.
+  Node() : left(0), right(0), count(0), level(0) {}
+  ~Node() = default;
 
-  void UpdateIndex(off_t of, const char* k) {
-    offset = of;
-    strncpy(key, k, kMaxKeySize);
+  // Wait for the writer, return false if the node is gone.
+  bool ReadLock(uint64_t* v) const {
+    for (int spin = 0;; ++spin) {
+      *v = Version().load(std::memory_order_acquire);
+      if ((*v & kLocked) == 0) return (*v & kObsolete) == 0;
+      if (spin > 64) std::this_thread::yield();
+    }
   }
-  void UpdateKey(const char* k) { strncpy(key, k, kMaxKeySize); }
-};
 
-struct BPlusTree::Record {
-  Key key;
-  Value value;
+  // Return whether nothing changed since ReadLock() returned v.
+  bool Validate(uint64_t v) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return Version().load(std::memory_order_relaxed) == v;
+  }
 
-  void UpdateKV(const char* k, const char* v) {
-    strncpy(key, k, kMaxKeySize);
-    strncpy(value, v, kMaxValueSize);
+  // Lock if nothing changed since ReadLock() returned v.
+  bool Upgrade(uint64_t v) {
+    return Version().compare_exchange_strong(v, v + kLocked,
+                                             std::memory_order_acquire);
   }
-  void UpdateKey(const char* k) { strncpy(key, k, kMaxKeySize); }
-  void UpdateValue(const char* v) { strncpy(value, v, kMaxValueSize); }
-};
 
-struct BPlusTree::Node {
-  Node() : parent(0), left(0), right(0), count(0) {}
-  Node(off_t parent_, off_t leaf_, off_t right_, size_t count_)
-      : parent(parent_), left(leaf_), right(right_), count(count_) {}
-  ~Node() = default;
+  void WriteLock() {
+    for (int spin = 0;; ++spin) {
+      uint64_t v = Version().load(std::memory_order_relaxed);
+      if ((v & kLocked) == 0 && Upgrade(v)) return;
+      if (spin > 64) std::this_thread::yield();
+    }
+  }
 
-  off_t offset;  // offset of self
-  off_t parent;  // offset of parent
-  off_t left;    // offset of left node(may be sibling)
-  off_t right;   // offset of right node(may be sibling)
-  size_t count;  // count of keys
+  void WriteUnlock() {
+    assert(Version().load(std::memory_order_relaxed) & kLocked);
+    Version().fetch_add(kLocked, std::memory_order_release);
+  }
+
+  std::atomic_ref<uint64_t> Version() const {
+    return std::atomic_ref<uint64_t>(version);
+  }
+
+  off_t offset;    // offset of self
+  off_t left;      // offset of left node(may be sibling)
+  off_t right;     // offset of right node(may be sibling)
+  uint32_t count;  // count of keys
+  uint32_t level;  // 0 for leaf nodes, height of subtree - 1 otherwise
+  alignas(8) mutable uint64_t version;
 };
 
+// Length of the common prefix of a and b.
+size_t CommonPrefixSize(std::string_view a, std::string_view b) {
+  size_t n = std::min(a.size(), b.size()), i = 0;
+  while (i < n && a[i] == b[i]) ++i;
+  return i;
+}
+
+// Fetch the header and the first slots of a node into the CPU cache.
+void PrefetchHead(const void* block) {
+  const char* p = static_cast<const char*>(block);
+  for (size_t line = 0; line < kPrefetchLines; ++line) {
+    __builtin_prefetch(p + line * kCacheLineSize);
+  }
+}
+
+// Bump the counter of level, counters by level grow with the tree.
+void CountAtLevel(std::vector<uint64_t>* counts, size_t level) {
+  if (counts->size() <= level) counts->resize(level + 1);
+  ++(*counts)[level];
+}
+
+// Shortest key k with left < k <= right.
+std::string_view Separator(std::string_view left, std::string_view right) {
+  assert(left < right);
+  return right.substr(0, CommonPrefixSize(left, right) + 1);
+}
+
+// First 4 bytes of k as a big-endian integer, zero padded, so that heads of
+// keys compare like the keys unless they are equal.
+uint32_t KeyHead(std::string_view k) {
+  unsigned char b[4] = {0, 0, 0, 0};
+  if (!k.empty()) std::memcpy(b, k.data(), std::min<size_t>(k.size(), 4));
+  return uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 |
+         uint32_t(b[3]);
+}
+
+void PutVarint(std::string* out, uint32_t v) {
+  for (; v >= 0x80; v >>= 7) out->push_back(static_cast<char>(v | 0x80));
+  out->push_back(static_cast<char>(v));
+}
+
+// Return false if the varint at *p runs past end.
+bool GetVarint(const char** p, const char* end, uint32_t* v) {
+  *v = 0;
+  for (int shift = 0; shift <= 28 && *p < end; shift += 7) {
+    uint8_t b = *(*p)++;
+    *v |= uint32_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// LZ77 over in: runs of literals alternate with copies of earlier bytes found
+// by a hash of their first 4, as varints of the literal count, the literals,
+// the distance back and the copy length beyond kMinMatch. The stream ends
+// with literals.
+const size_t kMinMatch = 4;
+
+void LzCompress(std::string_view in, std::string* out) {
+  constexpr int kHashBits = 12;
+  uint32_t table[1 << kHashBits] = {};  // last position + 1 by hash
+  size_t anchor = 0, i = 0;
+  while (i + kMinMatch <= in.size()) {
+    uint32_t word, candidate_word;
+    std::memcpy(&word, &in[i], sizeof(word));
+    uint32_t hash = (word * 2654435761u) >> (32 - kHashBits);
+    size_t candidate = table[hash];
+    table[hash] = i + 1;
+    if (candidate-- == 0) {
+      ++i;
+      continue;
+    }
+    std::memcpy(&candidate_word, &in[candidate], sizeof(candidate_word));
+    if (candidate_word != word) {
+      ++i;
+      continue;
+    }
+    size_t n = kMinMatch;
+    while (i + n < in.size() && in[candidate + n] == in[i + n]) ++n;
+    PutVarint(out, i - anchor);
+    out->append(in.substr(anchor, i - anchor));
+    PutVarint(out, i - candidate);
+    PutVarint(out, n - kMinMatch);
+    i += n;
+    anchor = i;
+  }
+  PutVarint(out, in.size() - anchor);
+  out->append(in.substr(anchor));
+}
+
+// Decompress [p, end) to the size bytes at out, return false unless that
+// is exactly what it holds.
+bool LzDecompress(const char* p, const char* end, char* out, size_t size) {
+  size_t pos = 0;
+  for (;;) {
+    uint32_t n, distance;
+    if (!GetVarint(&p, end, &n) || n > size - pos ||
+        n > static_cast<size_t>(end - p)) {
+      return false;
+    }
+    std::memcpy(&out[pos], p, n);
+    p += n;
+    pos += n;
+    if (pos == size) return p == end;
+    if (!GetVarint(&p, end, &distance) || !GetVarint(&p, end, &n) ||
+        distance == 0 || distance > pos || size - pos < kMinMatch ||
+        n > size - pos - kMinMatch) {
+      return false;
+    }
+    n += kMinMatch;
+    if (distance >= n) {
+      std::memcpy(&out[pos], &out[pos - distance], n);
+      pos += n;
+    } else {
+      // The copy overlaps the bytes it produces.
+      for (; n > 0; --n, ++pos) out[pos] = out[pos - distance];
+    }
+  }
+}
+
+// Index node is a slotted page: slots grow from the front of data and keys
+// are packed from the back. There are count keys and count + 1 slots, the
+// key of the last slot is always empty. The prefix shared by all keys is
+// stored once, slots only keep the rest of the key and its head.
 struct BPlusTree::IndexNode : BPlusTree::Node {
-  IndexNode() = default;
+  static constexpr int kSizeClass = 1;
+
+  struct Slot {
+    off_t child;        // offset of child left to key
+    uint16_t offset;    // offset of key suffix in data
+    uint16_t key_size;  // size of key suffix
+    uint32_t head;      // KeyHead() of key suffix
+  };
+
+  static constexpr size_t kDataSize =
+      kIndexNodeSize - sizeof(Node) - 4 * sizeof(uint32_t);
+  // Merge or borrow when fewer bytes than this are used.
+  static constexpr size_t kMinUsedSize = kDataSize * 3 / 8;
+  // Bytes off the middle a split may move to find a shorter separator.
+  static constexpr size_t kSplitWindow = kDataSize / 8;
+  static constexpr size_t kMaxCount = kDataSize / sizeof(Slot) - 1;
+  static_assert(kDataSize <= UINT16_MAX, "Slot offset should fit in 16 bits.");
+  static_assert(sizeof(Slot) + kMaxKeySize <= kDataSize / 4,
+                "IndexNode should hold at least 4 keys.");
+
+  IndexNode() : heap(kDataSize), garbage(0), prefix_offset(0), prefix_size(0) {
+    Slots()[0] = Slot{0, 0, 0, 0};
+  }
   ~IndexNode() = default;
 
-  const char* FirstKey() const {
-    assert(count > 0);
-    return indexes[0].key;
+  Slot* Slots() { return reinterpret_cast<Slot*>(data); }
+  const Slot* Slots() const { return reinterpret_cast<const Slot*>(data); }
+
+  std::string_view Prefix() const { return Bytes(prefix_offset, prefix_size); }
+
+  std::string_view Suffix(int index) const {
+    assert(index >= 0);
+    assert(index <= static_cast<int>(kMaxCount));
+    const Slot& slot = Slots()[index];
+    return Bytes(slot.offset, slot.key_size);
   }
 
-  const char* LastKey() const {
+  std::string FirstKey() const {
     assert(count > 0);
-    return indexes[count - 1].key;
+    return Key(0);
   }
 
-  const char* Key(int index) const {
+  std::string LastKey() const {
     assert(count > 0);
-    assert(index >= 0);
-    assert(index <= kOrder);
-    return indexes[index].key;
+    return Key(count - 1);
   }
 
-  void UpdateKey(int index, const char* k) {
+  std::string Key(int index) const {
+    std::string k(Prefix());
+    k.append(Suffix(index));
+    return k;
+  }
+
+  off_t Child(int index) const {
     assert(index >= 0);
-    assert(index <= kOrder);
-    indexes[index].UpdateKey(k);
+    assert(index <= static_cast<int>(kMaxCount));
+    return Slots()[index].child;
   }
 
-  void UpdateOffset(int index, off_t offset) {
+  // count, bounded for readers that race a writer.
+  int Count() const { return std::min<uint32_t>(count, kMaxCount); }
+
+  // Bytes in data, bounded for readers that race a writer.
+  std::string_view Bytes(size_t offset, size_t size) const {
+    offset = std::min(offset, kDataSize);
+    return std::string_view(&data[offset], std::min(size, kDataSize - offset));
+  }
+
+  // Bytes of slot and key suffix at index.
+  size_t EntrySize(int index) const {
+    return sizeof(Slot) + Slots()[index].key_size;
+  }
+
+  // Bytes of slots, prefix and live key suffixes.
+  size_t UsedSize() const {
+    return (count + 1) * sizeof(Slot) + kDataSize - heap - garbage;
+  }
+
+  bool Underfull() const { return UsedSize() < kMinUsedSize; }
+
+  // Bytes between slots and keys.
+  size_t FreeSize() const { return heap - (count + 1) * sizeof(Slot); }
+
+  // Extra bytes to store k, including the bytes every suffix grows by if the
+  // prefix has to be shortened for k.
+  size_t KeyCost(std::string_view k) const {
+    size_t n = CommonPrefixSize(Prefix(), k);
+    return k.size() - n + count * (prefix_size - n);
+  }
+
+  bool CanInsert(std::string_view k) const {
+    return sizeof(Slot) + KeyCost(k) <= FreeSize() + garbage;
+  }
+
+  bool CanUpdateKey(int index, std::string_view k) const {
+    return KeyCost(k) <= FreeSize() + garbage + Slots()[index].key_size;
+  }
+
+  // Bytes used after merging sibling and the key k between them.
+  size_t MergedSize(const IndexNode* sibling, std::string_view k) const {
+    size_t n = std::min(CommonPrefixSize(Prefix(), k),
+                        CommonPrefixSize(sibling->Prefix(), k));
+    size_t keys = KeysSize() + sibling->KeysSize() + k.size();
+    size_t key_count = count + sibling->count + 1;
+    return (key_count + 1) * sizeof(Slot) + n + keys - key_count * n;
+  }
+
+  void UpdateKey(int index, std::string_view k) {
     assert(index >= 0);
-    assert(index <= kOrder);
-    indexes[index].offset = offset;
+    assert(index < static_cast<int>(count));
+    assert(CanUpdateKey(index, k));
+    FitPrefix(k);
+    std::string_view suffix = k.substr(prefix_size);
+    Slot& slot = Slots()[index];
+    if (suffix.size() <= slot.key_size) {
+      std::memcpy(&data[slot.offset], suffix.data(), suffix.size());
+      garbage += slot.key_size - suffix.size();
+      slot.key_size = suffix.size();
+      slot.head = KeyHead(suffix);
+      return;
+    }
+    garbage += slot.key_size;
+    slot.key_size = 0;
+    slot.offset = AllocKey(suffix);
+    slot.key_size = suffix.size();
+    slot.head = KeyHead(suffix);
   }
 
-  void UpdateIndex(int index, const char* k, off_t offset) {
+  void UpdateOffset(int index, off_t offset) {
     assert(index >= 0);
-    assert(index <= kOrder);
-    UpdateKey(index, k);
-    UpdateOffset(index, offset);
+    assert(index <= static_cast<int>(count));
+    Slots()[index].child = offset;
   }
 
+  // Delete key at index and the child left to it.
   void DeleteKeyAtIndex(int index) {
     assert(index >= 0);
-    assert(index <= kOrder);
-    std::memmove(&indexes[index], &indexes[index + 1],
-                 sizeof(indexes[0]) * (count-- - index));
+    assert(index < static_cast<int>(count));
+    Slot* slots = Slots();
+    garbage += slots[index].key_size;
+    std::memmove(&slots[index], &slots[index + 1],
+                 sizeof(Slot) * (count-- - index));
+  }
+
+  // Delete the last key and the last child.
+  void DeleteLastKey() {
+    assert(count > 0);
+    Slot& slot = Slots()[--count];
+    garbage += slot.key_size;
+    slot.key_size = 0;
   }
 
-  void InsertKeyAtIndex(int index, const char* k) {
+  // Insert key at index with the child left to it.
+  void InsertIndexAtIndex(int index, std::string_view k, off_t offset) {
     assert(index >= 0);
-    assert(index <= kOrder);
-    std::memmove(&indexes[index + 1], &indexes[index],
-                 sizeof(indexes[0]) * (++count - index));
-    UpdateKey(index, k);
+    assert(index <= static_cast<int>(count));
+    assert(CanInsert(k));
+    FitPrefix(k);
+    std::string_view suffix = k.substr(prefix_size);
+    if (FreeSize() < sizeof(Slot) + suffix.size()) Compact(prefix_size);
+    uint16_t key_offset = AllocKey(suffix);
+    Slot* slots = Slots();
+    std::memmove(&slots[index + 1], &slots[index],
+                 sizeof(Slot) * (++count - index));
+    slots[index] = Slot{offset, key_offset,
+                        static_cast<uint16_t>(suffix.size()), KeyHead(suffix)};
+  }
+
+  // Prepend keys and childs of left sibling, separated by key k.
+  void MergeLeftSibling(const IndexNode* sibling, std::string_view k) {
+    assert(MergedSize(sibling, k) <= kDataSize);
+    for (size_t i = 0; i < sibling->count; ++i) {
+      InsertIndexAtIndex(i, sibling->Key(i), sibling->Child(i));
+    }
+    InsertIndexAtIndex(sibling->count, k, sibling->Child(sibling->count));
+    Compact(OptimalPrefixSize());
   }
 
-  void InsertIndexAtIndex(int index, const char* k, off_t offset) {
+  // Append keys and childs of right sibling, separated by key k.
+  void MergeRightSibling(const IndexNode* sibling, std::string_view k) {
+    assert(MergedSize(sibling, k) <= kDataSize);
+    InsertIndexAtIndex(count, k, Child(count));
+    for (size_t i = 0; i < sibling->count; ++i) {
+      UpdateOffset(count, sibling->Child(i));
+      InsertIndexAtIndex(count, sibling->Key(i), sibling->Child(i));
+    }
+    UpdateOffset(count, sibling->Child(sibling->count));
+    Compact(OptimalPrefixSize());
+  }
+
+  // Move keys after index and childs after index to an empty sibling, key at
+  // index is dropped and the child left to it becomes the last child. The
+  // sibling is left with only the last child if index is the last key.
+  void MoveTail(int index, IndexNode* sibling) {
     assert(index >= 0);
-    assert(index <= kOrder);
-    std::memmove(&indexes[index + 1], &indexes[index],
-                 sizeof(indexes[0]) * (++count - index));
-    UpdateIndex(index, k, offset);
+    assert(index < static_cast<int>(count));
+    assert(sibling->count == 0);
+    std::string prefix;
+    if (index + 1 < static_cast<int>(count)) prefix = Key(index + 1);
+    if (index + 2 < static_cast<int>(count)) {
+      prefix.resize(prefix_size +
+                    CommonPrefixSize(Suffix(index + 1), Suffix(count - 1)));
+    }
+    sibling->SetPrefix(prefix);
+    for (size_t i = index + 1; i < count; ++i) {
+      sibling->InsertIndexAtIndex(sibling->count, Key(i), Child(i));
+    }
+    sibling->UpdateOffset(sibling->count, Child(count));
+    Slot* slots = Slots();
+    for (size_t i = index; i < count; ++i) garbage += slots[i].key_size;
+    slots[index].key_size = 0;
+    count = index;
+    Compact(OptimalPrefixSize());
   }
 
-  void MergeLeftSibling(IndexNode* sibling) {
-    std::memmove(&indexes[sibling->count + 1], &indexes[0],
-                 sizeof(indexes[0]) * (count + 1));
-    std::memcpy(&indexes[0], &sibling->indexes[0],
-                sizeof(indexes[0]) * (sibling->count + 1));
-    count += (sibling->count + 1);
+  // Size of the prefix shared by the first and the last key.
+  size_t OptimalPrefixSize() const {
+    if (count == 0) return prefix_size;
+    return prefix_size + CommonPrefixSize(Suffix(0), Suffix(count - 1));
   }
 
-  void MergeRightSibling(IndexNode* sibling) {
-    std::memcpy(&indexes[count], &sibling->indexes[0],
-                sizeof(indexes[0]) * (sibling->count + 1));
-    count += sibling->count;
+  // Set prefix of an empty node.
+  void SetPrefix(std::string_view prefix) {
+    assert(count == 0);
+    heap = kDataSize - prefix.size();
+    garbage = 0;
+    std::memcpy(&data[heap], prefix.data(), prefix.size());
+    prefix_offset = heap;
+    prefix_size = prefix.size();
+  }
+
+  // Shorten prefix so that k starts with it.
+  void FitPrefix(std::string_view k) {
+    size_t n = CommonPrefixSize(Prefix(), k);
+    if (n < prefix_size) Compact(n);
   }
 
-  Index indexes[kOrder + 1];
+  // Repack prefix and keys so that all free bytes are between slots and
+  // keys, the prefix is changed to the first n bytes of the keys.
+  void Compact(size_t n) {
+    assert(n <= OptimalPrefixSize());
+    std::string prefix = count > 0 ? Key(0) : std::string(Prefix());
+    prefix.resize(n);
+    std::string_view old_prefix = Prefix();
+    char buf[kDataSize];
+    size_t top = kDataSize;
+    Slot* slots = Slots();
+    for (size_t i = 0; i < count; ++i) {
+      size_t cut = std::min(n, old_prefix.size());
+      std::string_view head = old_prefix.substr(cut);
+      std::string_view tail = Suffix(i).substr(n - cut);
+      top -= head.size() + tail.size();
+      std::memcpy(&buf[top], head.data(), head.size());
+      std::memcpy(&buf[top + head.size()], tail.data(), tail.size());
+      slots[i].offset = top;
+      slots[i].key_size = head.size() + tail.size();
+      slots[i].head = KeyHead(std::string_view(&buf[top], slots[i].key_size));
+    }
+    top -= n;
+    std::memcpy(&buf[top], prefix.data(), n);
+    assert(top >= (count + 1) * sizeof(Slot));
+    std::memcpy(&data[top], &buf[top], kDataSize - top);
+    heap = top;
+    garbage = 0;
+    prefix_offset = top;
+    prefix_size = n;
+  }
+
+  uint16_t AllocKey(std::string_view k) {
+    if (FreeSize() < k.size()) Compact(prefix_size);
+    assert(FreeSize() >= k.size());
+    heap -= k.size();
+    std::memcpy(&data[heap], k.data(), k.size());
+    return heap;
+  }
+
+  // Total bytes of all keys with prefix.
+  size_t KeysSize() const {
+    return UsedSize() - (count + 1) * sizeof(Slot) - prefix_size +
+           count * prefix_size;
+  }
+
+  uint32_t heap;           // offset of the lowest key in data
+  uint32_t garbage;        // bytes of deleted keys below heap
+  uint32_t prefix_offset;  // offset of prefix shared by all keys in data
+  uint32_t prefix_size;    // size of prefix shared by all keys
+  char data[kDataSize];
 };
 
+// Leaf node is a slotted page: slots grow from the front of data, keys and
+// values are packed from the back. Compaction puts all keys in order right
+// above the free space and all values after them, so a search only touches
+// the slots and a run of keys. Keys are stored whole, slots keep the head of
+// the key after the prefix shared by all keys.
 struct BPlusTree::LeafNode : BPlusTree::Node {
-  LeafNode() = default;
+  static constexpr int kSizeClass = 0;
+
+  struct Slot {
+    uint32_t head;          // KeyHead() of key suffix
+    uint16_t offset;        // offset of key in data
+    uint16_t key_size;      // size of key
+    uint16_t value_offset;  // offset of value in data
+    uint16_t value_size;    // size of value
+  };
+
+  static constexpr size_t kDataSize =
+      kLeafNodeSize - sizeof(Node) - 3 * sizeof(uint32_t);
+  // Merge or borrow when fewer bytes than this are used.
+  static constexpr size_t kMinUsedSize = kDataSize * 3 / 8;
+  // Bytes off the middle a split may move to find a shorter separator.
+  static constexpr size_t kSplitWindow = kDataSize / 8;
+  static constexpr size_t kMaxCount = kDataSize / sizeof(Slot) - 1;
+  // A record and its slot take at most a quarter of a leaf, so that merging
+  // is always possible when borrowing is not.
+  static constexpr size_t kMaxRecordSize = kDataSize / 4;
+  static_assert(kDataSize <= UINT16_MAX, "Slot offset should fit in 16 bits.");
+  static_assert(sizeof(Slot) + kMaxKeySize <= kMaxRecordSize,
+                "LeafNode should hold at least 4 keys.");
+
+  LeafNode() : heap(kDataSize), garbage(0), prefix_size(0) {}
   ~LeafNode() = default;
 
-  const char* FirstKey() const {
+  Slot* Slots() { return reinterpret_cast<Slot*>(data); }
+  const Slot* Slots() const { return reinterpret_cast<const Slot*>(data); }
+
+  std::string_view FirstKey() const {
     assert(count > 0);
-    return records[0].key;
+    return Key(0);
   }
 
-  const char* LastKey() const {
+  std::string_view LastKey() const {
     assert(count > 0);
-    return records[count - 1].key;
+    return Key(count - 1);
   }
 
-  const char* Key(int index) const {
-    assert(count > 0);
+  std::string_view Key(int index) const {
     assert(index >= 0);
-    return records[index].key;
+    assert(index < static_cast<int>(kMaxCount));
+    const Slot& slot = Slots()[index];
+    return Bytes(slot.offset, slot.key_size);
   }
 
-  const char* FirstValue() const {
-    assert(count > 0);
-    return records[0].value;
+  std::string_view Value(int index) const {
+    assert(index >= 0);
+    assert(index < static_cast<int>(kMaxCount));
+    const Slot& slot = Slots()[index];
+    return Bytes(slot.value_offset, slot.value_size);
   }
 
-  const char* LastValue() const {
-    assert(count > 0);
-    return records[count - 1].value;
+  std::string_view Prefix() const {
+    return Count() == 0 ? std::string_view() : Key(0).substr(0, prefix_size);
   }
 
-  const char* Value(int index) const {
-    assert(count > 0);
-    return records[index].value;
+  std::string_view Suffix(int index) const {
+    std::string_view k = Key(index);
+    return k.substr(std::min<size_t>(prefix_size, k.size()));
   }
 
-  void UpdateValue(int index, const char* v) {
-    assert(index >= 0);
-    records[index].UpdateValue(v);
+  // count, bounded for readers that race a writer.
+  int Count() const { return std::min<uint32_t>(count, kMaxCount); }
+
+  // Bytes in data, bounded for readers that race a writer.
+  std::string_view Bytes(size_t offset, size_t size) const {
+    offset = std::min(offset, kDataSize);
+    return std::string_view(&data[offset], std::min(size, kDataSize - offset));
   }
 
-  void UpdateKey(int index, const char* k) {
-    assert(index >= 0);
-    records[index].UpdateKey(k);
+  static size_t RecordSize(std::string_view k, std::string_view v) {
+    return sizeof(Slot) + k.size() + v.size();
+  }
+
+  size_t RecordSize(int index) const {
+    const Slot& slot = Slots()[index];
+    return sizeof(Slot) + slot.key_size + slot.value_size;
+  }
+
+  // Bytes of slots and live records.
+  size_t UsedSize() const {
+    return count * sizeof(Slot) + kDataSize - heap - garbage;
+  }
+
+  bool Underfull() const { return UsedSize() < kMinUsedSize; }
+
+  // Bytes between slots and records.
+  size_t FreeSize() const { return heap - count * sizeof(Slot); }
+
+  bool CanInsert(std::string_view k, std::string_view v) const {
+    return RecordSize(k, v) <= FreeSize() + garbage;
   }
 
-  void UpdateKV(int index, const char* k, const char* v) {
+  // Update value in place, return false if it does not fit.
+  bool UpdateValue(int index, std::string_view v) {
     assert(index >= 0);
-    records[index].UpdateKV(k, v);
+    assert(index < static_cast<int>(count));
+    Slot& slot = Slots()[index];
+    if (v.size() <= slot.value_size) {
+      std::memcpy(&data[slot.value_offset], v.data(), v.size());
+      garbage += slot.value_size - v.size();
+      slot.value_size = v.size();
+      return true;
+    }
+    if (v.size() > FreeSize() + garbage + slot.value_size) return false;
+    garbage += slot.value_size;
+    slot.value_size = 0;
+    if (FreeSize() < v.size()) Compact();
+    slot.value_offset = AllocBytes(v);
+    slot.value_size = v.size();
+    return true;
   }
 
-  void InsertKVAtIndex(int index, const char* k, const char* v) {
+  void InsertKVAtIndex(int index, std::string_view k, std::string_view v) {
     assert(index >= 0);
-    assert(index < kOrder);
-    std::memmove(&records[index + 1], &records[index],
-                 sizeof(records[0]) * (count++ - index));
-    UpdateKV(index, k, v);
+    assert(index <= static_cast<int>(count));
+    assert(CanInsert(k, v));
+    if (FreeSize() < RecordSize(k, v)) Compact();
+    uint16_t value_offset = AllocBytes(v);
+    uint16_t key_offset = AllocBytes(k);
+    // Only a new first or last key can shorten the prefix.
+    if (count == 0) {
+      prefix_size = k.size();
+    } else if (index == 0 || index == static_cast<int>(count)) {
+      size_t n = CommonPrefixSize(k, Key(index == 0 ? count - 1 : 0));
+      if (n < prefix_size) SetHeads(n);
+    }
+    Slot* slots = Slots();
+    std::memmove(&slots[index + 1], &slots[index],
+                 sizeof(Slot) * (count++ - index));
+    slots[index] = Slot{KeyHead(k.substr(prefix_size)), key_offset,
+                        static_cast<uint16_t>(k.size()), value_offset,
+                        static_cast<uint16_t>(v.size())};
   }
 
   void DeleteKVAtIndex(int index) {
     assert(index >= 0);
-    assert(index < kOrder);
-    std::memmove(&records[index], &records[index + 1],
-                 sizeof(records[0]) * (--count - index));
+    assert(index < static_cast<int>(count));
+    Slot* slots = Slots();
+    garbage += slots[index].key_size + slots[index].value_size;
+    std::memmove(&slots[index], &slots[index + 1],
+                 sizeof(Slot) * (--count - index));
   }
 
-  void MergeLeftSibling(LeafNode* sibling) {
-    std::memmove(&records[sibling->count], &records[0],
-                 sizeof(records[0]) * count);
-    std::memcpy(&records[0], &sibling->records[0],
-                sizeof(records[0]) * sibling->count);
+  void MergeLeftSibling(const LeafNode* sibling) {
+    assert(UsedSize() + sibling->UsedSize() <= kDataSize);
+    Compact();
+    Slot* slots = Slots();
+    std::memmove(&slots[sibling->count], &slots[0], sizeof(Slot) * count);
+    for (size_t i = 0; i < sibling->count; ++i) {
+      const Slot& slot = sibling->Slots()[i];
+      uint16_t value_offset = AllocBytes(sibling->Value(i));
+      slots[i] = Slot{0, AllocBytes(sibling->Key(i)), slot.key_size,
+                      value_offset, slot.value_size};
+    }
     count += sibling->count;
+    Compact();
   }
 
-  void MergeRightSibling(LeafNode* sibling) {
-    std::memcpy(&records[count], &sibling->records[0],
-                sizeof(records[0]) * sibling->count);
-    count += sibling->count;
+  void MergeRightSibling(const LeafNode* sibling) {
+    assert(UsedSize() + sibling->UsedSize() <= kDataSize);
+    Compact();
+    for (size_t i = 0; i < sibling->count; ++i) {
+      InsertKVAtIndex(count, sibling->Key(i), sibling->Value(i));
+    }
   }
 
-  BPlusTree::Record records[kOrder];
-};
+  // Drop all records, links and version stay.
+  void Clear() {
+    count = 0;
+    heap = kDataSize;
+    garbage = 0;
+    prefix_size = 0;
+  }
 
-class BPlusTree::BlockCache {
-  struct Node;
+  // Move records from index to an empty sibling.
+  void MoveTail(int index, LeafNode* sibling) {
+    assert(index >= 0);
+    assert(index <= static_cast<int>(count));
+    assert(sibling->count == 0);
+    for (size_t i = index; i < count; ++i) {
+      sibling->InsertKVAtIndex(sibling->count, Key(i), Value(i));
+      garbage += RecordSize(i) - sizeof(Slot);
+    }
+    count = index;
+    sibling->Compact();
+  }
 
- public:
-  BlockCache() : head_(new Node()), size_(0) {
-    head_->next = head_;
-    head_->prev = head_;
+  // Repack values and then keys, both in key order, so that all free bytes
+  // are between slots and keys, and make the prefix as long as the keys
+  // allow.
+  void Compact() {
+    char buf[kDataSize];
+    size_t top = kDataSize;
+    Slot* slots = Slots();
+    for (int i = count - 1; i >= 0; --i) {
+      top -= slots[i].value_size;
+      std::memcpy(&buf[top], &data[slots[i].value_offset], slots[i].value_size);
+      slots[i].value_offset = top;
+    }
+    for (int i = count - 1; i >= 0; --i) {
+      top -= slots[i].key_size;
+      std::memcpy(&buf[top], &data[slots[i].offset], slots[i].key_size);
+      slots[i].offset = top;
+    }
+    std::memcpy(&data[top], &buf[top], kDataSize - top);
+    heap = top;
+    garbage = 0;
+    if (count > 0) SetHeads(CommonPrefixSize(FirstKey(), LastKey()));
   }
 
-  ~BlockCache() {
-    for (auto it = offset2node_.begin(); it != offset2node_.end(); it++) {
-      Node* node = it->second;
-      off_t page_offset = node->offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-      char* start = reinterpret_cast<char*>(node->block);
-      void* addr = static_cast<void*>(&start[page_offset - node->offset]);
-      if (munmap(addr, node->size + node->offset - page_offset) != 0) {
-        Exit("munmap");
-      }
-      delete node;
+  // Change the prefix to the first n bytes of the keys.
+  void SetHeads(size_t n) {
+    prefix_size = n;
+    Slot* slots = Slots();
+    for (size_t i = 0; i < count; ++i) {
+      slots[i].head = KeyHead(Suffix(i));
     }
-    delete head_;
   }
 
-  void DeleteNode(Node* node) {
-    if (node->next == node->prev && nullptr == node->next) return;
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
-    node->next = node->prev = nullptr;
-    size_ -= node->size;
+  // Whole pages of page_size bytes between slots and records, as offsets
+  // [*begin, *end) from the start of the node.
+  void FreePages(size_t page_size, size_t* begin, size_t* end) const {
+    size_t start = data - reinterpret_cast<const char*>(this);
+    size_t low = start + Count() * sizeof(Slot);
+    size_t high = start + std::min<size_t>(heap, kDataSize);
+    *begin = (low + page_size - 1) & ~(page_size - 1);
+    *end = std::max(*begin, high & ~(page_size - 1));
   }
 
-  void InsertHead(Node* node) {
-    node->next = head_->next;
-    node->prev = head_;
-    head_->next->prev = node;
-    head_->next = node;
-    size_ += node->size;
+  // Header of a leaf stored encoded in the file. tag takes the place of
+  // offset and is odd, so it is never mistaken for a block offset.
+  struct Encoded {
+    off_t tag;
+    off_t left;
+    off_t right;
+    uint64_t version;
+    uint32_t size;  // bytes including the header
+    uint32_t count;
+    uint32_t key_bytes;  // of whole keys
+    uint32_t value_bytes;
+    uint32_t prefix_size;
+  };
+
+  static off_t Tag(off_t offset) { return offset | 1; }
+
+  // Keys in order, each as the size of the prefix it shares with the key
+  // before and the rest, then all values through LzCompress(). Return the
+  // size padded to whole pages, or 0 if that saves no page.
+  size_t Encode(std::string* out) const {
+    Encoded header{Tag(offset), left, right, version, 0, count, 0, 0, 0};
+    if (count > 0) {
+      header.prefix_size = CommonPrefixSize(FirstKey(), LastKey());
+    }
+    out->assign(sizeof(header), '\0');
+    std::string values;
+    std::string_view previous;
+    for (size_t i = 0; i < count; ++i) {
+      std::string_view k = Key(i), v = Value(i);
+      size_t shared = CommonPrefixSize(previous, k);
+      PutVarint(out, shared);
+      PutVarint(out, k.size() - shared);
+      out->append(k.substr(shared));
+      PutVarint(out, v.size());
+      values.append(v);
+      header.key_bytes += k.size();
+      previous = k;
+    }
+    header.value_bytes = values.size();
+    LzCompress(values, out);
+    header.size = out->size();
+    std::memcpy(out->data(), &header, sizeof(header));
+    size_t padded = (out->size() + kPageSize - 1) & ~(kPageSize - 1);
+    if (padded >= sizeof(LeafNode)) return 0;
+    out->resize(padded, '\0');
+    return padded;
   }
 
-  Node* DeleteTail() {
-    if (size_ == 0) {
-      assert(head_->next == head_);
-      assert(head_->prev == head_);
-      return nullptr;
+  // Rebuild the leaf Encode() wrote to in, compacted, with the longest
+  // prefix. Return false if it is inconsistent.
+  bool Decode(const char* in) {
+    Encoded header;
+    std::memcpy(&header, in, sizeof(header));
+    if (header.size < sizeof(header) || header.size > sizeof(LeafNode) ||
+        header.count > kMaxCount ||
+        header.count * sizeof(Slot) + header.key_bytes + header.value_bytes >
+            kDataSize) {
+      return false;
+    }
+    offset = header.tag & ~off_t(1);
+    left = header.left;
+    right = header.right;
+    count = header.count;
+    level = 0;
+    version = header.version;
+    heap = kDataSize - header.key_bytes - header.value_bytes;
+    garbage = 0;
+    prefix_size = header.prefix_size;
+
+    // Keys follow each other from heap, values from the end of the keys.
+    const char* p = in + sizeof(header);
+    const char* end = in + header.size;
+    const size_t keys_end = kDataSize - header.value_bytes;
+    size_t key_offset = heap, value_offset = keys_end, previous = 0;
+    Slot* slots = Slots();
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t shared, rest, value_size;
+      if (!GetVarint(&p, end, &shared) || !GetVarint(&p, end, &rest) ||
+          shared > previous || rest > static_cast<size_t>(end - p) ||
+          shared + rest > keys_end - key_offset ||
+          shared + rest < prefix_size) {
+        return false;
+      }
+      std::memcpy(&data[key_offset], &data[key_offset - previous], shared);
+      std::memcpy(&data[key_offset + shared], p, rest);
+      p += rest;
+      if (!GetVarint(&p, end, &value_size) ||
+          value_size > kDataSize - value_offset) {
+        return false;
+      }
+      std::string_view k(&data[key_offset], shared + rest);
+      slots[i] = Slot{KeyHead(k.substr(prefix_size)),
+                      static_cast<uint16_t>(key_offset),
+                      static_cast<uint16_t>(shared + rest),
+                      static_cast<uint16_t>(value_offset),
+                      static_cast<uint16_t>(value_size)};
+      key_offset += shared + rest;
+      value_offset += value_size;
+      previous = shared + rest;
+    }
+    if (key_offset != keys_end || value_offset != kDataSize ||
+        !LzDecompress(p, end, &data[keys_end], header.value_bytes)) {
+      return false;
     }
-    Node* tail = head_->prev;
-    DeleteNode(tail);
-    return tail;
+    return true;
   }
 
-  template <typename T>
-  void Put(T* block) {
-    while (size_ > kMaxCacheSize) Kick();
+  // Callers make room first, a compaction here would drop bytes not yet
+  // referenced by a slot.
+  uint16_t AllocBytes(std::string_view b) {
+    assert(FreeSize() >= b.size());
+    heap -= b.size();
+    std::memcpy(&data[heap], b.data(), b.size());
+    return heap;
+  }
 
-    if (offset2node_.find(block->offset) == offset2node_.end()) {
-      Node* node = new Node(block, block->offset, sizeof(T));
-      offset2node_.emplace(block->offset, node);
-      InsertHead(node);
-    } else {
-      Node* node = offset2node_[block->offset];
-      if (--node->ref == 0) InsertHead(node);
+  uint32_t heap;         // offset of the lowest key or value in data
+  uint32_t garbage;      // bytes of deleted keys and values below heap
+  uint32_t prefix_size;  // size of prefix shared by all keys
+  char data[kDataSize];
+};
+
+// A link of the chain that saves free blocks of one size class while the db
+// file is closed, it occupies a recycled IndexNode block.
+struct BPlusTree::FreeListBlock {
+  static constexpr int kCapacity =
+      (sizeof(IndexNode) - 3 * sizeof(off_t)) / sizeof(off_t);
+
+  off_t offset;  // offset of self
+  off_t next;    // offset of next link
+  size_t count;  // count of blocks
+  off_t blocks[kCapacity];
+};
+
+// Latency histograms and a ring of structure changes, written by any thread
+// without locking. Histogram buckets keep the 5 highest bits of a value, so
+// each power of two is split into 16 buckets. Readers of the ring skip slots
+// a writer is filling.
+class BPlusTree::Tracer {
+ public:
+  class Scope {
+   public:
+    Scope(Tracer* tracer, Phase phase)
+        : tracer_(tracer), phase_(phase), start_(Now()) {}
+    ~Scope() { tracer_->Record(phase_, Now() - start_); }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    Tracer* tracer_;
+    Phase phase_;
+    uint64_t start_;
+  };
+
+  Tracer() : next_(0) {
+    for (auto& counts : counts_) {
+      for (auto& count : counts) count.store(0, std::memory_order_relaxed);
     }
+    for (auto& max : max_) max.store(0, std::memory_order_relaxed);
+    for (Slot& slot : ring_) slot.seq.store(0, std::memory_order_relaxed);
   }
 
-  template <typename T>
-  T* Get(int fd, off_t offset) {
-    if (offset2node_.find(offset) == offset2node_.end()) {
-      struct stat st;
-      if (fstat(fd, &st) != 0) Exit("fstat");
-      constexpr int size = sizeof(T);
-      if (st.st_size < offset + size && ftruncate(fd, offset + size) != 0) {
-        Exit("ftruncate");
-      }
-      // Align offset to page size.
-      // See http://man7.org/linux/man-pages/man2/mmap.2.html
-      off_t page_offset = offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-      void* addr = mmap(nullptr, size + offset - page_offset,
-                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_offset);
-      if (MAP_FAILED == addr) Exit("mmap");
-      char* start = static_cast<char*>(addr);
-      return reinterpret_cast<T*>(&start[offset - page_offset]);
-    }
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
 
-    Node* node = offset2node_[offset];
-    ++node->ref;
-    DeleteNode(node);
-    return static_cast<T*>(node->block);
+  void Record(Phase phase, uint64_t ns) {
+    int i = static_cast<int>(phase);
+    counts_[i][Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = max_[i].load(std::memory_order_relaxed);
+    while (ns > max && !max_[i].compare_exchange_weak(
+                           max, ns, std::memory_order_relaxed)) {
+    }
   }
 
- private:
-  void Kick() {
-    Node* tail = DeleteTail();
-    if (nullptr == tail) return;
+  Histogram Latency(Phase phase) const {
+    int i = static_cast<int>(phase);
+    Histogram histogram;
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+      uint64_t count = counts_[i][bucket].load(std::memory_order_relaxed);
+      if (count == 0) continue;
+      histogram.count += count;
+      histogram.buckets.emplace_back(Highest(bucket), count);
+    }
+    histogram.max = max_[i].load(std::memory_order_relaxed);
+    return histogram;
+  }
 
-    assert(tail != head_);
+  void Event(TraceEvent::Type type, uint32_t level, off_t offset) {
+    uint64_t seq = next_.fetch_add(1, std::memory_order_relaxed) + 1;
+    Slot& slot = ring_[seq % kTraceEvents];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time_ns.store(Now(), std::memory_order_relaxed);
+    slot.type_level.store(uint64_t{type} << 32 | level,
+                          std::memory_order_relaxed);
+    slot.offset.store(offset, std::memory_order_relaxed);
+    slot.seq.store(seq, std::memory_order_release);
+  }
 
-    off_t page_offset = tail->offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-    char* start = reinterpret_cast<char*>(tail->block);
-    void* addr = static_cast<void*>(&start[page_offset - tail->offset]);
-    if (munmap(addr, tail->size + tail->offset - page_offset) != 0) {
-      Exit("munmap");
+  std::vector<TraceEvent> Events() const {
+    std::vector<TraceEvent> events;
+    uint64_t end = next_.load(std::memory_order_acquire);
+    uint64_t begin = end > kTraceEvents ? end - kTraceEvents : 0;
+    for (uint64_t seq = begin + 1; seq <= end; ++seq) {
+      const Slot& slot = ring_[seq % kTraceEvents];
+      if (slot.seq.load(std::memory_order_acquire) != seq) continue;
+      TraceEvent event;
+      event.time_ns = slot.time_ns.load(std::memory_order_relaxed);
+      uint64_t type_level = slot.type_level.load(std::memory_order_relaxed);
+      event.type = static_cast<TraceEvent::Type>(type_level >> 32);
+      event.level = static_cast<uint32_t>(type_level);
+      event.offset = slot.offset.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == seq) {
+        events.push_back(event);
+      }
     }
-    offset2node_.erase(tail->offset);
-    delete tail;
+    return events;
   }
 
-  struct Node {
-    Node()
-        : block(nullptr),
-          offset(0),
-          size(0),
-          ref(0),
-          prev(nullptr),
-          next(nullptr) {}
+ private:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  // Values below 2 * kSubBuckets have a bucket each, the others share one
+  // per kSubBuckets-th of their power of two.
+  static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  static size_t Bucket(uint64_t value) {
+    int shift =
+        std::max<int>(std::bit_width(value) - kSubBucketBits - 1, 0);
+    return shift * kSubBuckets + (value >> shift);
+  }
 
-    Node(void* block_, off_t offset_, size_t size_)
-        : block(block_),
-          offset(offset_),
-          size(size_),
-          ref(1),
-          prev(nullptr),
-          next(nullptr) {}
+  static uint64_t Highest(size_t bucket) {
+    if (bucket < 2 * kSubBuckets) return bucket;
+    int shift = bucket / kSubBuckets - 1;
+    uint64_t mantissa = bucket % kSubBuckets + kSubBuckets;
+    return ((mantissa + 1) << shift) - 1;
+  }
 
-    void* block;
-    off_t offset;
-    size_t size;
-    size_t ref;
-    Node* prev;
-    Node* next;
+  struct Slot {
+    std::atomic<uint64_t> seq;  // 0 while it is filled
+    std::atomic<uint64_t> time_ns;
+    std::atomic<uint64_t> type_level;
+    std::atomic<off_t> offset;
   };
 
-  Node* head_;
-  size_t size_;
-  std::unordered_map<off_t, Node*> offset2node_;
+  std::atomic<uint64_t> counts_[static_cast<int>(Phase::kPhaseCount)]
+                               [kBuckets];
+  std::atomic<uint64_t> max_[static_cast<int>(Phase::kPhaseCount)];
+  std::atomic<uint64_t> next_;  // events written
+  Slot ring_[kTraceEvents];
 };
 
-BPlusTree::BPlusTree(const char* path)
-    : fd_(open(path, O_CREAT | O_RDWR, 0600)), block_cache_(new BlockCache()) {
-  if (fd_ == -1) Exit("open");
-  meta_ = Map<Meta>(kMetaOffset);
-  if (meta_->height == 0) {
-    // Initialize B+tree;
-    constexpr off_t of_root = kMetaOffset + sizeof(Meta);
-    LeafNode* root = new (Map<LeafNode>(of_root)) LeafNode();
-    root->offset = of_root;
-    meta_->height = 1;
-    meta_->root = of_root;
-    meta_->block = of_root + sizeof(LeafNode);
-    UnMap<LeafNode>(root);
+// Write all of size bytes at offset, Exit() on errors.
+void PWrite(int fd, const char* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) Exit("pwrite");
+    data += n;
+    size -= n;
+    offset += n;
   }
 }
 
-BPlusTree::~BPlusTree() {
-  UnMap(meta_);
-  delete block_cache_;
-  close(fd_);
+// Read size bytes at offset, zeros beyond the end of the file. Exit() on
+// errors.
+void PRead(int fd, char* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) Exit("pread");
+    if (n == 0) {
+      std::memset(data, 0, size);
+      return;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
 }
 
-void BPlusTree::Put(const std::string& key, const std::string& value) {
-  // 1. Find Leaf node.
-  off_t of_leaf = GetLeafOffset(key.data());
-  LeafNode* leaf_node = Map<LeafNode>(of_leaf);
-  if (InsertKVIntoLeafNode(leaf_node, key.data(), value.data()) <=
-      GetMaxKeys()) {
-    // 2.If records of leaf node less than or equals kOrder - 1 then finish.
-    UnMap<LeafNode>(leaf_node);
-    return;
+// Deallocate size bytes at offset in the file, they read back as zeros.
+// Return false if the file system can not, Exit() on other errors.
+bool PunchHole(int fd, off_t offset, size_t size) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                size) == 0) {
+    return true;
   }
+  if (errno != EOPNOTSUPP) Exit("fallocate");
+  return false;
+}
 
-  // 3. Split leaf node to two leaf nodes.
-  LeafNode* split_node = SplitLeafNode(leaf_node);
-  const char* mid_key = split_node->FirstKey();
-  IndexNode* parent_node = GetOrCreateParent(leaf_node);
-  off_t of_parent = leaf_node->parent;
-  split_node->parent = of_parent;
-
-  // 4.Insert key to parent of splited leaf nodes and
-  // link two splited left nodes to parent.
-  if (InsertKeyIntoIndexNode(parent_node, mid_key, leaf_node, split_node) <=
-      GetMaxKeys()) {
-    UnMap<LeafNode>(leaf_node);
-    UnMap<LeafNode>(split_node);
-    UnMap<IndexNode>(parent_node);
-    return;
+bool EncodeLeaves(const BPlusTree::Options& options) {
+  return kEncodeLeaves && options.compress_leaves &&
+         options.storage_mode == BPlusTree::StorageMode::kBuffered;
+}
+
+// Just enough io_uring for batches of reads and writes, through raw system
+// calls: they are queued in the submission ring, submitted together and
+// waited for. Not thread safe.
+class IoUring {
+ public:
+  // nullptr if the kernel does not support io_uring.
+  static std::unique_ptr<IoUring> Create(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return nullptr;
+    return std::unique_ptr<IoUring>(new IoUring(fd, params));
   }
 
-  // 5.Split index node from bottom to up repeatedly
-  // until count <= kOrder - 1.
-  size_t count;
-  do {
-    IndexNode* child_node = parent_node;
-    IndexNode* split_node = SplitIndexNode(child_node);
-    const char* mid_key = child_node->Key(child_node->count);
-    parent_node = GetOrCreateParent(child_node);
-    of_parent = child_node->parent;
-    split_node->parent = of_parent;
-    count =
-        InsertKeyIntoIndexNode(parent_node, mid_key, child_node, split_node);
-    UnMap<IndexNode>(child_node);
-  } while (count > GetMaxKeys());
-  UnMap<IndexNode>(parent_node);
-}
-
-bool BPlusTree::Delete(const std::string& key) {
-  off_t of_leaf = GetLeafOffset(key.data());
-  LeafNode* leaf_node = Map<LeafNode>(of_leaf);
-  // 1. Delete key from leaf node
-  int index = GetIndexFromLeafNode(leaf_node, key.data());
-  if (index == -1) {
-    UnMap(leaf_node);
-    return false;
+  ~IoUring() {
+    munmap(sqes_, entries_ * sizeof(io_uring_sqe));
+    munmap(sq_ring_, sq_ring_size_);
+    if (cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    close(fd_);
+  }
+
+  // Queue a write of iov[0, n) to fd at offset, iov must stay valid until
+  // Wait() returns.
+  void Writev(int fd, const iovec* iov, int n, off_t offset) {
+    Queue(IORING_OP_WRITEV, fd, iov, n, offset);
+  }
+
+  // Same for a read.
+  void Readv(int fd, const iovec* iov, int n, off_t offset) {
+    Queue(IORING_OP_READV, fd, iov, n, offset);
+  }
+
+  // Submit the queued operations and wait until all are done. Short reads
+  // and writes are finished with pread() and pwrite().
+  void Wait() {
+    unsigned submitted = 0, done = 0;
+    while (done < ops_.size()) {
+      int n = syscall(__NR_io_uring_enter, fd_, ops_.size() - submitted,
+                      ops_.size() - done, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) Exit("io_uring_enter");
+      submitted += n;
+      unsigned head = *cq_head_;
+      for (; head != std::atomic_ref<unsigned>(*cq_tail_).load(
+                         std::memory_order_acquire);
+           ++head, ++done) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        if (cqe.res < 0) {
+          errno = -cqe.res;
+          Exit("io_uring");
+        }
+        Finish(ops_[cqe.user_data], cqe.res);
+      }
+      std::atomic_ref<unsigned>(*cq_head_).store(head,
+                                                 std::memory_order_release);
+    }
+    ops_.clear();
+  }
+
+ private:
+  struct Op {
+    uint8_t opcode;
+    int fd;
+    const iovec* iov;
+    int n;
+    off_t offset;
+  };
+
+  void Queue(uint8_t opcode, int fd, const iovec* iov, int n, off_t offset) {
+    if (ops_.size() == entries_) Wait();
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(iov);
+    sqe->len = n;
+    sqe->off = offset;
+    sqe->user_data = ops_.size();
+    sq_array_[index] = index;
+    std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1,
+                                               std::memory_order_release);
+    ops_.push_back(Op{opcode, fd, iov, n, offset});
+  }
+
+  IoUring(int fd, const io_uring_params& params)
+      : fd_(fd), entries_(params.sq_entries) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_,
+                                                         cq_ring_size_);
+    sq_ring_ = MapRing(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single ? sq_ring_ : MapRing(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(
+        MapRing(entries_ * sizeof(io_uring_sqe), IORING_OFF_SQES));
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+  }
+
+  char* MapRing(size_t size, off_t offset) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, offset);
+    if (MAP_FAILED == addr) Exit("mmap");
+    return static_cast<char*>(addr);
+  }
+
+  // Read or write what the kernel left of op after done bytes.
+  static void Finish(const Op& op, size_t done) {
+    off_t offset = op.offset;
+    for (int i = 0; i < op.n; ++i) {
+      size_t skip = std::min(done, op.iov[i].iov_len);
+      done -= skip;
+      char* data = static_cast<char*>(op.iov[i].iov_base) + skip;
+      if (op.opcode == IORING_OP_READV) {
+        PRead(op.fd, data, op.iov[i].iov_len - skip, offset + skip);
+      } else {
+        PWrite(op.fd, data, op.iov[i].iov_len - skip, offset + skip);
+      }
+      offset += op.iov[i].iov_len;
+    }
+  }
+
+  int fd_;
+  unsigned entries_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  char* sq_ring_;
+  char* cq_ring_;
+  io_uring_sqe* sqes_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  std::vector<Op> ops_;  // queued or in flight, by user_data
+};
+
+// Cache of mapped blocks, partitioned by offset into shards. Every shard has
+// its own lock, queues, hash table and pool of entries, so that blocks of
+// different shards never contend and a miss does not allocate.
+//
+// Only blocks nobody references are queued for eviction. With 2Q, blocks
+// enter an "in" queue that holds a quarter of the shard and are remembered as
+// ghosts for a while after eviction. Blocks used again, index nodes and ghosts
+// missed again move to the "main" queue, so a scan only cycles through "in".
+// With LRU, all blocks are in main.
+class BPlusTree::BlockCache {
+  struct Node;
+  struct Shard;
+
+ public:
+  // With use_wal, blocks are mapped privately so that the file only changes
+  // when dirty blocks are captured and written back, and dirty blocks are not
+  // evicted until then.
+  BlockCache(int fd, const Options& options, Tracer* tracer)
+      : fd_(fd),
+        tracer_(tracer),
+        mode_(options.storage_mode),
+        policy_(options.cache_policy),
+        track_dirty_(options.use_wal),
+        sparse_leaves_(options.sparse_leaves),
+        compress_leaves_(EncodeLeaves(options)),
+        page_size_(sysconf(_SC_PAGE_SIZE)),
+        file_size_(0),
+        arena_(nullptr),
+        arena_size_(0),
+        dirty_size_(0),
+        shard_size_(std::max(options.cache_size / kCacheShards, kLeafNodeSize)),
+        shards_(new Shard[kCacheShards]),
+        mmaps_(0),
+        munmaps_(0),
+        ftruncates_(0),
+        hole_punches_(0),
+        reads_(0),
+        writes_(0) {
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      shards_[i].Init(shard_size_ / kIndexNodeSize);
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) Exit("fstat");
+    file_size_ = st.st_size;
+
+    if (mode_ == StorageMode::kArena) {
+      // Reserve address space once so that growing the arena never moves
+      // blocks that are already handed out.
+      void* addr = mmap(nullptr, kArenaReserveSize, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (MAP_FAILED == addr) Exit("mmap");
+      arena_ = static_cast<char*>(addr);
+    }
+    if (mode_ == StorageMode::kBuffered && options.use_io_uring) {
+      ring_ = IoUring::Create(kRingEntries);
+    }
+  }
+
+  ~BlockCache() {
+    if (mode_ != StorageMode::kArena) {
+      for (size_t i = 0; i < kCacheShards; ++i) {
+        Shard& shard = shards_[i];
+        for (Node* node : shard.buckets) {
+          for (; node != nullptr; node = node->hash_next) {
+            if (node->queue != kGhost) Release(shard, node, 0, 0);
+          }
+        }
+        WriteBack(shard);
+      }
+    }
+    delete[] shards_;
+    if (arena_ != nullptr && munmap(arena_, kArenaReserveSize) != 0) {
+      Exit("munmap");
+    }
+  }
+
+  template <typename T>
+  void Put(const T* block) {
+    Shard& shard = ShardOf(block->offset);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    while (shard.Size() > shard_size_) Kick(shard);
+    WriteBack(shard);
+
+    Node* node = shard.Find(block->offset);
+    assert(node != nullptr);
+    if (--node->ref == 0 && !node->dirty && !node->flushing) {
+      shard.InsertHead(node);
+    }
+  }
+
+  template <typename T>
+  T* Get(off_t offset, bool dirty) {
+    constexpr size_t size = sizeof(T);
+    Shard& shard = ShardOf(offset);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Node* node = shard.Find(offset);
+    if (node == nullptr || node->queue == kGhost) {
+      ++shard.misses;
+    } else {
+      ++shard.hits;
+    }
+    if (node == nullptr) {
+      node = shard.NewNode(Load(offset, size), offset, size);
+      node->leaf = std::is_same_v<T, LeafNode>;
+      node->queue = policy_ == CachePolicy::kLru ||
+                            std::is_same_v<T, IndexNode>
+                        ? kMain
+                        : kIn;
+    } else if (node->queue == kGhost) {
+      // Missed again soon after eviction, keep it longer this time.
+      shard.DeleteNode(node);
+      node->block = Load(offset, size);
+      node->size = size;
+      node->ref = 1;
+      node->leaf = std::is_same_v<T, LeafNode>;
+      node->changed = false;
+      node->queue = kMain;
+    } else {
+      if (node->ref++ == 0) {
+        // Used again after it was released, keep it longer.
+        shard.DeleteNode(node);
+        node->queue = kMain;
+      }
+      if (node->size < size) {
+        // The block was mapped as a smaller type (e.g. Node), map all of it.
+        assert(node->ref == 1);
+        void* block = Load(offset, size);
+        if (mode_ != StorageMode::kArena) {
+          // A private mapping or a buffer may hold changes the file does not
+          // have yet.
+          if (track_dirty_ || mode_ == StorageMode::kBuffered) {
+            std::memcpy(block, node->block, node->size);
+          }
+          UnMapBlock(node);
+        }
+        if (node->dirty) dirty_size_ += size - node->size;
+        node->block = block;
+        node->size = size;
+        node->leaf = std::is_same_v<T, LeafNode>;
+      }
+    }
+    if (dirty) node->changed = true;
+    if (dirty && track_dirty_ && !node->dirty) {
+      node->dirty = true;
+      shard.dirty.push_back(node);
+      dirty_size_ += node->size;
+    }
+    return static_cast<T*>(node->block);
+  }
+
+  // Read the distinct blocks at offsets that are not cached into the cache,
+  // all in one io_uring submission. Only buffered blocks can be read ahead
+  // like that, without io_uring or in the other modes blocks are loaded when
+  // they are used.
+  template <typename T>
+  void Prefetch(const std::vector<off_t>& offsets) {
+    constexpr size_t size = sizeof(T);
+    if (ring_ == nullptr || offsets.size() < 2) return;
+    // Lock the shards involved in order like Truncate(), and read while
+    // holding them like a miss in Get() does.
+    bool involved[kCacheShards] = {};
+    for (off_t offset : offsets) involved[ShardIndex(offset)] = true;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      if (involved[i]) locks.emplace_back(shards_[i].mutex);
+    }
+    std::vector<off_t> missing;
+    for (off_t offset : offsets) {
+      Node* node = ShardOf(offset).Find(offset);
+      if (node == nullptr || node->queue == kGhost) missing.push_back(offset);
+    }
+    if (missing.empty()) return;
+    // Offsets read from nodes that changed meanwhile may repeat.
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+    // Blocks read ahead wait in the "in" queue, read no more than it holds so
+    // that they are not evicted before they are used.
+    missing.resize(
+        std::min(missing.size(), locks.size() * shard_size_ / 4 / size));
+    if (missing.empty()) return;
+    std::vector<iovec> pieces(missing.size());
+    for (iovec& piece : pieces) {
+      if (posix_memalign(&piece.iov_base, page_size_, size) != 0) {
+        Exit("posix_memalign");
+      }
+      piece.iov_len = LeafHeadSize(size);
+    }
+    {
+      std::lock_guard<std::mutex> lock(ring_mutex_);
+      for (size_t i = 0; i < missing.size(); ++i) {
+        ring_->Readv(fd_, &pieces[i], 1, missing[i]);
+      }
+      ring_->Wait();
+    }
+    if (LeafHeadSize(size) < size) {
+      for (size_t i = 0; i < missing.size(); ++i) {
+        FinishLeaf(missing[i], static_cast<char*>(pieces[i].iov_base),
+                   pieces[i].iov_len);
+      }
+    }
+    reads_.fetch_add(missing.size(), std::memory_order_relaxed);
+
+    // Queue them unreferenced, as if they were used once.
+    for (size_t i = 0; i < missing.size(); ++i) {
+      Shard& shard = ShardOf(missing[i]);
+      ++shard.misses;
+      Node* node = shard.Find(missing[i]);
+      if (node == nullptr) {
+        node = shard.NewNode(pieces[i].iov_base, missing[i], size);
+        node->queue = policy_ == CachePolicy::kLru ||
+                              std::is_same_v<T, IndexNode>
+                          ? kMain
+                          : kIn;
+      } else {
+        shard.DeleteNode(node);
+        node->block = pieces[i].iov_base;
+        node->size = size;
+        node->changed = false;
+        node->queue = kMain;
+      }
+      node->leaf = std::is_same_v<T, LeafNode>;
+      node->ref = 0;
+      shard.InsertHead(node);
+    }
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      if (!involved[i]) continue;
+      while (shards_[i].Size() > shard_size_) Kick(shards_[i]);
+      WriteBack(shards_[i]);
+    }
+  }
+
+  // Bytes of blocks changed since the last capture.
+  size_t DirtySize() const {
+    return dirty_size_.load(std::memory_order_relaxed);
+  }
+
+  // Hand every dirty block to fn(offset, block, size). They stay pinned until
+  // ReleaseFlushed() is called, after the file has their content.
+  template <typename F>
+  void CaptureDirty(F fn) {
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      Shard& shard = shards_[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (Node* node : shard.dirty) {
+        fn(node->offset, node->block, node->size);
+        node->dirty = false;
+        dirty_size_ -= node->size;
+        if (!node->flushing) {
+          node->flushing = true;
+          shard.flushing.push_back(node);
+        }
+      }
+      shard.dirty.clear();
+    }
+  }
+
+  void ReleaseFlushed() {
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      Shard& shard = shards_[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (Node* node : shard.flushing) {
+        node->flushing = false;
+        if (node->ref == 0 && !node->dirty) shard.InsertHead(node);
+      }
+      shard.flushing.clear();
+    }
+  }
+
+  // Shrink the file to size bytes, or to the end of the last block beyond it
+  // that is still referenced. Other blocks beyond it are dropped, a reader
+  // that comes across one later maps it again and grows the file.
+  void Truncate(off_t size) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      locks.emplace_back(shards_[i].mutex);
+    }
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      Shard& shard = shards_[i];
+      std::vector<Node*> beyond;
+      for (Node* node : shard.buckets) {
+        for (; node != nullptr; node = node->hash_next) {
+          if (node->offset + static_cast<off_t>(node->size) > size) {
+            beyond.push_back(node);
+          }
+        }
+      }
+      for (Node* node : beyond) {
+        if (node->ref > 0 || node->dirty || node->flushing) {
+          size = std::max<off_t>(size, node->offset + node->size);
+          continue;
+        }
+        // Blocks beyond size are free, their content does not matter.
+        shard.DeleteNode(node);
+        if (node->queue != kGhost && mode_ != StorageMode::kArena) {
+          UnMapBlock(node);
+        }
+        shard.FreeNode(node);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    if (size >= file_size_) return;
+    size_t arena_size = arena_size_.load(std::memory_order_relaxed);
+    if (mode_ == StorageMode::kArena && static_cast<size_t>(size) < arena_size) {
+      // Pages past the end of the file can not be touched, back them with
+      // zeros until the arena grows over them again.
+      void* addr = mmap(arena_ + size, arena_size - size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+      if (MAP_FAILED == addr) Exit("mmap");
+      arena_size_.store(size, std::memory_order_release);
+    }
+    if (ftruncate(fd_, size) != 0) Exit("ftruncate");
+    ftruncates_.fetch_add(1, std::memory_order_relaxed);
+    file_size_ = size;
+  }
+
+  void AddStats(Statistics* stats) const {
+    for (size_t i = 0; i < kCacheShards; ++i) {
+      Shard& shard = shards_[i];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      stats->cache_hits += shard.hits;
+      stats->cache_misses += shard.misses;
+      stats->evictions += shard.evictions;
+      for (Node* node : shard.buckets) {
+        for (; node != nullptr; node = node->hash_next) {
+          if (node->queue != kGhost) stats->cached_bytes += node->size;
+        }
+      }
+    }
+    stats->mmaps += mmaps_.load(std::memory_order_relaxed);
+    stats->munmaps += munmaps_.load(std::memory_order_relaxed);
+    stats->ftruncates += ftruncates_.load(std::memory_order_relaxed);
+    stats->hole_punches += hole_punches_.load(std::memory_order_relaxed);
+    stats->reads += reads_.load(std::memory_order_relaxed);
+    stats->writes += writes_.load(std::memory_order_relaxed);
+    if (mode_ == StorageMode::kArena) {
+      stats->mapped_bytes += arena_size_.load(std::memory_order_relaxed);
+    } else if (mode_ == StorageMode::kBlockMap) {
+      stats->mapped_bytes += stats->cached_bytes;
+    }
+  }
+
+ private:
+  enum Queue : uint8_t { kIn, kMain, kGhost };
+
+  struct Node {
+    Node()
+        : block(nullptr),
+          offset(0),
+          size(0),
+          ref(0),
+          dirty(false),
+          flushing(false),
+          leaf(false),
+          changed(false),
+          queue(kMain),
+          prev(nullptr),
+          next(nullptr),
+          hash_next(nullptr) {}
+
+    void* block;  // nullptr for ghosts
+    off_t offset;
+    size_t size;
+    size_t ref;
+    bool dirty;     // changed since the last capture
+    bool flushing;  // captured but not written back to the file yet
+    bool leaf;
+    bool changed;   // mapped for writing since it was loaded
+    Queue queue;    // queue it is in or returns to once unreferenced
+    Node* prev;
+    Node* next;
+    Node* hash_next;  // next in bucket, or in the free pool
+  };
+
+  // A changed buffer leaving the cache, written back but for the pages in
+  // [hole_begin, hole_end) punched out of the file.
+  struct Write {
+    off_t offset;
+    char* block;
+    size_t size;
+    size_t hole_begin;
+    size_t hole_end;
+  };
+
+  struct Shard {
+    Shard()
+        : sizes{0, 0, 0},
+          count(0),
+          pool(nullptr),
+          pool_chunk(0),
+          hits(0),
+          misses(0),
+          evictions(0) {
+      for (Node& head : heads) {
+        head.next = &head;
+        head.prev = &head;
+      }
+    }
+
+    // Entries to allocate at once, enough for a full shard of the smallest
+    // blocks. The pool only grows when more blocks than that are pinned.
+    void Init(size_t chunk) {
+      pool_chunk = chunk;
+      buckets.resize(std::bit_ceil(pool_chunk), nullptr);
+      GrowPool();
+    }
+
+    static size_t Hash(off_t offset) {
+      return static_cast<uint64_t>(offset) * 0x9E3779B97F4A7C15ULL >> 32;
+    }
+
+    Node* Find(off_t offset) const {
+      Node* node = buckets[Hash(offset) & (buckets.size() - 1)];
+      while (node != nullptr && node->offset != offset) node = node->hash_next;
+      return node;
+    }
+
+    Node* NewNode(void* block, off_t offset, size_t size) {
+      if (pool == nullptr) GrowPool();
+      if (count == buckets.size()) Rehash(buckets.size() * 2);
+      Node* node = pool;
+      pool = node->hash_next;
+      *node = Node();
+      node->block = block;
+      node->offset = offset;
+      node->size = size;
+      node->ref = 1;
+      Node*& bucket = buckets[Hash(offset) & (buckets.size() - 1)];
+      node->hash_next = bucket;
+      bucket = node;
+      ++count;
+      return node;
+    }
+
+    void FreeNode(Node* node) {
+      Node** link = &buckets[Hash(node->offset) & (buckets.size() - 1)];
+      while (*link != node) link = &(*link)->hash_next;
+      *link = node->hash_next;
+      --count;
+      node->hash_next = pool;
+      pool = node;
+    }
+
+    void GrowPool() {
+      chunks.emplace_back(new Node[pool_chunk]);
+      for (size_t i = 0; i < pool_chunk; ++i) {
+        chunks.back()[i].hash_next = pool;
+        pool = &chunks.back()[i];
+      }
+    }
+
+    void Rehash(size_t bucket_count) {
+      std::vector<Node*> old(bucket_count, nullptr);
+      old.swap(buckets);
+      for (Node* node : old) {
+        while (node != nullptr) {
+          Node* next = node->hash_next;
+          Node*& bucket = buckets[Hash(node->offset) & (bucket_count - 1)];
+          node->hash_next = bucket;
+          bucket = node;
+          node = next;
+        }
+      }
+    }
+
+    // Bytes of queued blocks, ghosts take none.
+    size_t Size() const { return sizes[kIn] + sizes[kMain]; }
+
+    void DeleteNode(Node* node) {
+      if (node->next == node->prev && nullptr == node->next) return;
+      node->prev->next = node->next;
+      node->next->prev = node->prev;
+      node->next = node->prev = nullptr;
+      sizes[node->queue] -= node->size;
+    }
+
+    // Queue node at the head of its queue.
+    void InsertHead(Node* node) {
+      Node& head = heads[node->queue];
+      node->next = head.next;
+      node->prev = &head;
+      head.next->prev = node;
+      head.next = node;
+      sizes[node->queue] += node->size;
+    }
+
+    Node* DeleteTail(Queue queue) {
+      Node& head = heads[queue];
+      if (head.prev == &head) {
+        assert(sizes[queue] == 0);
+        return nullptr;
+      }
+      Node* tail = head.prev;
+      DeleteNode(tail);
+      return tail;
+    }
+
+    std::mutex mutex;  // guards everything below and the entries
+    Node heads[3];     // sentinels of the queues, most recent first
+    size_t sizes[3];   // bytes of blocks in the queues
+    size_t count;      // entries in buckets
+    std::vector<Node*> buckets;
+    Node* pool;  // free entries
+    size_t pool_chunk;
+    uint64_t hits;
+    uint64_t misses;  // including ghosts
+    uint64_t evictions;
+    std::vector<std::unique_ptr<Node[]>> chunks;
+    std::vector<Node*> dirty;
+    std::vector<Node*> flushing;
+    std::vector<Write> writes;  // evicted buffers to write back
+  };
+
+  static size_t ShardIndex(off_t offset) {
+    uint64_t hash = static_cast<uint64_t>(offset) * 0x9E3779B97F4A7C15ULL;
+    return hash >> (64 - kCacheShardBits);
+  }
+
+  Shard& ShardOf(off_t offset) const { return shards_[ShardIndex(offset)]; }
+
+  // Grow the file so that it is at least size bytes.
+  void Reserve(off_t size) {
+    std::lock_guard<std::mutex> lock(file_mutex_);
+    if (file_size_ >= size) return;
+    if (ftruncate(fd_, size) != 0) Exit("ftruncate");
+    ftruncates_.fetch_add(1, std::memory_order_relaxed);
+    file_size_ = size;
+  }
+
+  void* Load(off_t offset, size_t size) {
+    TRACE_SCOPE(tracer_, kLoad);
+    switch (mode_) {
+      case StorageMode::kArena:
+        return GetArenaBlock(offset, size);
+      case StorageMode::kBuffered:
+        return ReadBlock(offset, size);
+      default:
+        return MapBlock(offset, size);
+    }
+  }
+
+  void* ReadBlock(off_t offset, size_t size) {
+    Reserve(offset + size);
+    void* block;
+    if (posix_memalign(&block, page_size_, size) != 0) Exit("posix_memalign");
+    size_t head = LeafHeadSize(size);
+    PRead(fd_, static_cast<char*>(block), head, offset);
+    if (head < size) FinishLeaf(offset, static_cast<char*>(block), head);
+    reads_.fetch_add(1, std::memory_order_relaxed);
+    return block;
+  }
+
+  // Bytes to read first of a block of size. An encoded leaf mostly fits in
+  // its first page, read the rest only once it turns out to be needed.
+  size_t LeafHeadSize(size_t size) const {
+    return kEncodeLeaves && compress_leaves_ && size == kLeafNodeSize
+               ? kPageSize
+               : size;
+  }
+
+  // Complete a leaf of which the first head bytes were read into block:
+  // decode it if it is stored encoded, read the rest of it otherwise. Only
+  // called with compress_leaves_ on, still leaves that encode to as many
+  // pages and those written before the file had the option stay raw.
+  void FinishLeaf(off_t offset, char* block, size_t head) {
+    LeafNode::Encoded header;
+    std::memcpy(&header, block, sizeof(header));
+    if (header.tag != LeafNode::Tag(offset)) {
+      PRead(fd_, block + head, kLeafNodeSize - head, offset + head);
+      return;
+    }
+    size_t size = std::min<size_t>(header.size, kLeafNodeSize);
+    std::unique_ptr<char[]> encoded(new char[size]);
+    std::memcpy(encoded.get(), block, std::min(head, size));
+    if (size > head) PRead(fd_, &encoded[head], size - head, offset + head);
+    if (!reinterpret_cast<LeafNode*>(block)->Decode(encoded.get())) {
+      errno = EINVAL;
+      Exit("decode leaf");
+    }
+  }
+
+  // Free the buffer of a block leaving the cache, after writing it back if
+  // the file misses its changes. With the log on, the file gets them at
+  // checkpoints, and dirty blocks do not leave before.
+  void Release(Shard& shard, Node* node, size_t hole_begin, size_t hole_end) {
+    if (mode_ == StorageMode::kBuffered && !track_dirty_ && node->changed) {
+      char* block = static_cast<char*>(node->block);
+      size_t size = node->size;
+      if (compress_leaves_ && node->leaf) {
+        // Write the leaf encoded in place of its buffer, and punch the pages
+        // it no longer takes. Nobody reads them before the write is done.
+        std::string encoded;
+        size_t encoded_size =
+            static_cast<const LeafNode*>(node->block)->Encode(&encoded);
+        if (encoded_size != 0) {
+          if (PunchHole(fd_, node->offset + encoded_size,
+                        size - encoded_size)) {
+            hole_punches_.fetch_add(1, std::memory_order_relaxed);
+          }
+          if (posix_memalign(reinterpret_cast<void**>(&block), page_size_,
+                             encoded_size) != 0) {
+            Exit("posix_memalign");
+          }
+          std::memcpy(block, encoded.data(), encoded_size);
+          size = encoded_size;
+          free(node->block);
+        }
+      }
+      shard.writes.push_back(
+          Write{node->offset, block, size, hole_begin, hole_end});
+    } else {
+      UnMapBlock(node);
+    }
+  }
+
+  // Write back the buffers released since the last call and free them. The
+  // shard lock is held throughout, so nobody reads the blocks from the file
+  // before they are written. With io_uring, pieces that follow each other in
+  // the file go out as one write, and all of them in one submission.
+  void WriteBack(Shard& shard) {
+    if (shard.writes.empty()) return;
+    std::vector<iovec> pieces;
+    std::vector<off_t> offsets;
+    std::sort(shard.writes.begin(), shard.writes.end(),
+              [](const Write& a, const Write& b) { return a.offset < b.offset; });
+    for (const Write& write : shard.writes) {
+      auto add = [&](size_t begin, size_t end) {
+        if (begin == end) return;
+        pieces.push_back(iovec{write.block + begin, end - begin});
+        offsets.push_back(write.offset + begin);
+      };
+      if (write.hole_begin == write.hole_end) {
+        add(0, write.size);
+      } else {
+        add(0, write.hole_begin);
+        add(write.hole_end, write.size);
+      }
+    }
+    if (ring_ == nullptr) {
+      for (size_t i = 0; i < pieces.size(); ++i) {
+        PWrite(fd_, static_cast<const char*>(pieces[i].iov_base),
+               pieces[i].iov_len, offsets[i]);
+      }
+    } else {
+      std::lock_guard<std::mutex> lock(ring_mutex_);
+      for (size_t i = 0, j; i < pieces.size(); i = j) {
+        off_t end = offsets[i] + pieces[i].iov_len;
+        for (j = i + 1; j < pieces.size() && j - i < IOV_MAX &&
+                        offsets[j] == end;
+             ++j) {
+          end += pieces[j].iov_len;
+        }
+        ring_->Writev(fd_, &pieces[i], j - i, offsets[i]);
+      }
+      ring_->Wait();
+    }
+    writes_.fetch_add(shard.writes.size(), std::memory_order_relaxed);
+    for (const Write& write : shard.writes) free(write.block);
+    shard.writes.clear();
+  }
+
+  void* MapBlock(off_t offset, size_t size) {
+    Reserve(offset + size);
+    // Align offset to page size.
+    // See http://man7.org/linux/man-pages/man2/mmap.2.html
+    off_t page_offset = offset & ~(page_size_ - 1);
+    void* addr = mmap(nullptr, size + offset - page_offset,
+                      PROT_READ | PROT_WRITE, MapFlags(), fd_, page_offset);
+    if (MAP_FAILED == addr) Exit("mmap");
+    mmaps_.fetch_add(1, std::memory_order_relaxed);
+    char* start = static_cast<char*>(addr);
+    return &start[offset - page_offset];
+  }
+
+  void UnMapBlock(Node* node) {
+    if (mode_ == StorageMode::kBuffered) {
+      free(node->block);
+      return;
+    }
+    off_t page_offset = node->offset & ~(page_size_ - 1);
+    char* start = static_cast<char*>(node->block);
+    void* addr = static_cast<void*>(&start[page_offset - node->offset]);
+    if (munmap(addr, node->size + node->offset - page_offset) != 0) {
+      Exit("munmap");
+    }
+    munmaps_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void* GetArenaBlock(off_t offset, size_t size) {
+    if (arena_size_.load(std::memory_order_acquire) < offset + size) {
+      // Map the missing extents of the file behind the ones already mapped,
+      // growing the file a whole extent at a time.
+      off_t new_size =
+          (offset + size + kArenaExtentSize - 1) & ~(kArenaExtentSize - 1);
+      assert(static_cast<size_t>(new_size) <= kArenaReserveSize);
+      Reserve(new_size);
+      std::lock_guard<std::mutex> lock(file_mutex_);
+      size_t arena_size = arena_size_.load(std::memory_order_relaxed);
+      if (arena_size < static_cast<size_t>(new_size)) {
+        void* addr = mmap(arena_ + arena_size, new_size - arena_size,
+                          PROT_READ | PROT_WRITE, MapFlags() | MAP_FIXED, fd_,
+                          arena_size);
+        if (MAP_FAILED == addr) Exit("mmap");
+        mmaps_.fetch_add(1, std::memory_order_relaxed);
+        arena_size_.store(new_size, std::memory_order_release);
+      }
+    }
+    return arena_ + offset;
+  }
+
+  // Deallocate the free pages of an unreferenced leaf in the file, they read
+  // back as zeros, and set [*begin, *end) to them. Nobody maps the leaf
+  // meanwhile, and the file has its content since dirty blocks are not
+  // evicted, or gets the rest of it when a buffer is written back.
+  void PunchFreePages(Node* node, size_t* hole_begin, size_t* hole_end) {
+    LeafNode* leaf_node = static_cast<LeafNode*>(node->block);
+    size_t begin, end;
+    *hole_begin = *hole_end = 0;
+    leaf_node->FreePages(page_size_, &begin, &end);
+    if (!track_dirty_ &&
+        leaf_node->garbage >= static_cast<size_t>(page_size_)) {
+      // Changes go to the file without a checkpoint, pack the records first
+      // so that deleted ones free pages too.
+      leaf_node->WriteLock();
+      leaf_node->Compact();
+      leaf_node->WriteUnlock();
+      leaf_node->FreePages(page_size_, &begin, &end);
+    }
+    if (begin == end) return;
+    if (PunchHole(fd_, node->offset + begin, end - begin)) {
+      hole_punches_.fetch_add(1, std::memory_order_relaxed);
+      *hole_begin = begin;
+      *hole_end = end;
+      return;
+    }
+    // The file system keeps every block allocated.
+    sparse_leaves_.store(false, std::memory_order_relaxed);
+  }
+
+  int MapFlags() const { return track_dirty_ ? MAP_PRIVATE : MAP_SHARED; }
+
+  void Kick(Shard& shard) {
+    TRACE_SCOPE(tracer_, kEvict);
+    Queue queue = shard.sizes[kIn] > shard_size_ / 4 || shard.sizes[kMain] == 0
+                      ? kIn
+                      : kMain;
+    Node* tail = shard.DeleteTail(queue);
+    if (nullptr == tail) return;
+    ++shard.evictions;
+
+    size_t hole_begin = 0, hole_end = 0;
+    // Encoded leaves take the place of raw ones in the file.
+    if (tail->leaf && tail->changed && !compress_leaves_ &&
+        sparse_leaves_.load(std::memory_order_relaxed)) {
+      PunchFreePages(tail, &hole_begin, &hole_end);
+    }
+    if (mode_ == StorageMode::kArena) {
+      // Pages stay mapped, only tell the kernel they are cold. Private copies
+      // of clean blocks can be dropped, the file has their content. Pages
+      // shared with neighbouring blocks are left alone.
+      off_t begin = (tail->offset + page_size_ - 1) & ~(page_size_ - 1);
+      off_t end = (tail->offset + tail->size) & ~(page_size_ - 1);
+      if (begin < end) {
+        madvise(arena_ + begin, end - begin,
+                track_dirty_ ? MADV_DONTNEED : MADV_COLD);
+      }
+    } else {
+      Release(shard, tail, hole_begin, hole_end);
+    }
+    if (queue == kMain) {
+      shard.FreeNode(tail);
+      return;
+    }
+
+    // Remember it, ghosts are dropped once they stand for more than half of
+    // the shard.
+    tail->block = nullptr;
+    tail->queue = kGhost;
+    shard.InsertHead(tail);
+    while (shard.sizes[kGhost] > shard_size_ / 2) {
+      shard.FreeNode(shard.DeleteTail(kGhost));
+    }
+  }
+
+  int fd_;
+  Tracer* tracer_;
+  StorageMode mode_;
+  CachePolicy policy_;
+  bool track_dirty_;
+  std::atomic<bool> sparse_leaves_;
+  bool compress_leaves_;
+  off_t page_size_;
+  std::mutex file_mutex_;  // guards growing the file and the arena
+  off_t file_size_;
+  char* arena_;                     // start of reserved address space
+  std::atomic<size_t> arena_size_;  // bytes of the file mapped into the arena
+  std::atomic<size_t> dirty_size_;
+  size_t shard_size_;  // bytes of blocks a shard keeps unreferenced
+  Shard* shards_;
+  std::mutex ring_mutex_;  // guards ring_
+  std::unique_ptr<IoUring> ring_;  // nullptr unless use_io_uring worked
+  std::atomic<uint64_t> mmaps_;
+  std::atomic<uint64_t> munmaps_;
+  std::atomic<uint64_t> ftruncates_;
+  std::atomic<uint64_t> hole_punches_;
+  std::atomic<uint64_t> reads_;
+  std::atomic<uint64_t> writes_;
+};
+
+// Redo log of Put and Delete, split into segments named <path>.wal.<seq>.
+// While it is on, blocks are mapped privately so that the db file only
+// changes at checkpoints: dirty blocks are copied, appended to the segment
+// being retired and only then written back to the db file in the background.
+// Recovery applies the last complete checkpoint and replays the records
+// after it.
+class BPlusTree::Wal {
+ public:
+  enum RecordType : uint8_t {
+    kPut = 1,
+    kDelete,
+    kCheckpointBegin,
+    kImage,  // key is the offset of the block, value its content
+    kCheckpointEnd,
+    kBatch,  // value holds the puts and deletes of WriteBatch, see AddToBatch()
+  };
+
+  struct Record {
+    RecordType type;
+    std::string key;
+    std::string value;
+  };
+
+  // An operation of a batch is type, size of key, size of value, key and
+  // value.
+  static void AddToBatch(std::string* batch, RecordType type,
+                         std::string_view key, std::string_view value) {
+    uint32_t sizes[2] = {static_cast<uint32_t>(key.size()),
+                         static_cast<uint32_t>(value.size())};
+    batch->push_back(type);
+    batch->append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+    batch->append(key);
+    batch->append(value);
+  }
+
+  // Blocks captured at a checkpoint, already encoded as records.
+  struct Checkpoint {
+    struct Image {
+      off_t offset;  // in the db file
+      size_t pos;    // of the content in records
+      size_t size;
+    };
+
+    void AddImage(off_t offset, const void* block, size_t size) {
+      images.push_back(Image{offset,
+                             records.size() + kHeaderSize + 1 +
+                                 sizeof(uint32_t) + sizeof(offset),
+                             size});
+      Encode(&records, kImage,
+             std::string_view(reinterpret_cast<const char*>(&offset),
+                              sizeof(offset)),
+             std::string_view(static_cast<const char*>(block), size));
+    }
+
+    std::string records;
+    std::vector<Image> images;
+  };
+
+  // Apply checkpoints and collect the records to replay from segments seq,
+  // seq + 1, ... of path, set *end_seq to the first missing segment.
+  static std::vector<Record> Recover(const std::string& path, int db_fd,
+                                     uint64_t seq, const Options& options,
+                                     uint64_t* end_seq);
+
+  // Start a new segment seq, segments from first_seq on before it are removed
+  // by the next checkpoint.
+  Wal(const std::string& path, int db_fd, uint64_t first_seq, uint64_t seq,
+      const Options& options);
+  ~Wal();
+
+  // Return the log sequence number after the record.
+  uint64_t Append(RecordType type, std::string_view key,
+                  std::string_view value);
+
+  // Make the record ending at lsn as durable as the sync policy asks.
+  void Commit(uint64_t lsn) {
+    if (policy_ == SyncPolicy::kEveryOp) Sync(lsn);
+  }
+
+  // Write and fdatasync() everything up to lsn. Writers that wait meanwhile
+  // are committed by the same fdatasync().
+  void Sync(uint64_t lsn);
+
+  // Bytes in the current segment.
+  size_t SegmentSize() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return segment_size_;
+  }
+
+  bool CheckpointRunning() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return job_ != nullptr;
+  }
+
+  void WaitCheckpoint() {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this] { return job_ == nullptr; });
+  }
+
+  // Close the current segment and start segment Seq() + 1 unless closing.
+  // Captured blocks are written to the closed segment and then back to the
+  // db file in the background, or before returning if wait.
+  void StartCheckpoint(Checkpoint* checkpoint, bool closing, bool wait);
+
+  uint64_t Seq() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return seq_;
+  }
+
+ private:
+  struct Job {
+    std::unique_ptr<Checkpoint> checkpoint;
+    int fd;              // closed segment
+    uint64_t first_seq;  // segments to remove after the checkpoint
+    uint64_t last_seq;
+  };
+
+  static constexpr uint64_t kMagic = 0x4c41572b54504231;  // "1BPT+WAL"
+  // Checksum and size of payload.
+  static constexpr size_t kHeaderSize = 2 * sizeof(uint32_t);
+  static constexpr size_t kBufferSize = 64 * 1024;
+
+  static std::string SegmentPath(const std::string& path, uint64_t seq) {
+    return path + ".wal." + std::to_string(seq);
+  }
+
+  // Write block images back to the db file, leaves encoded if
+  // compress_leaves. The meta block goes last, once the others are durable,
+  // since its wal_seq tells recovery to skip the checkpoint they come from.
+  static void WriteBack(
+      int db_fd,
+      const std::vector<std::tuple<off_t, const char*, size_t>>& images,
+      bool compress_leaves) {
+    // Images sit anywhere in the log, copy leaves out aligned to encode them.
+    std::unique_ptr<char[]> leaf;
+    std::string encoded;
+    for (bool meta : {false, true}) {
+      for (auto [offset, block, size] : images) {
+        if ((offset == kMetaOffset) != meta) continue;
+        if (compress_leaves && size == kLeafNodeSize) {
+          if (leaf == nullptr) leaf.reset(new char[kLeafNodeSize]);
+          std::memcpy(leaf.get(), block, size);
+          size_t encoded_size =
+              reinterpret_cast<const LeafNode*>(leaf.get())->Encode(&encoded);
+          if (encoded_size != 0) {
+            PunchHole(db_fd, offset + encoded_size, size - encoded_size);
+            block = encoded.data();
+            size = encoded_size;
+          }
+        }
+        PWrite(db_fd, block, size, offset);
+      }
+      if (fdatasync(db_fd) != 0) Exit("fdatasync");
+    }
+  }
+
+  // Payload is type, size of key, key and value.
+  static void Encode(std::string* buffer, RecordType type,
+                     std::string_view key, std::string_view value) {
+    uint32_t key_size = key.size();
+    uint32_t size = 1 + sizeof(key_size) + key.size() + value.size();
+    size_t start = buffer->size();
+    buffer->append(kHeaderSize, '\0');
+    buffer->push_back(type);
+    buffer->append(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+    buffer->append(key);
+    buffer->append(value);
+    char* header = &(*buffer)[start];
+    std::memcpy(&header[sizeof(uint32_t)], &size, sizeof(size));
+    uint32_t checksum = Crc32(&header[sizeof(uint32_t)], sizeof(size) + size);
+    std::memcpy(header, &checksum, sizeof(checksum));
+  }
+
+  static uint32_t Crc32(const char* data, size_t size) {
+    static const std::vector<uint32_t> table = [] {
+      std::vector<uint32_t> t(256);
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        t[i] = c;
+      }
+      return t;
+    }();
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; ++i) {
+      crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+  }
+
+  static void WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = write(fd, data, size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) Exit("write");
+      data += n;
+      size -= n;
+    }
+  }
+
+  int OpenSegment(uint64_t seq);
+  void FlushLocked(std::unique_lock<std::mutex>& lock);
+  void RunJob(Job* job);
+  void BackgroundWork();
+
+  const std::string path_;
+  const int db_fd_;
+  const bool compress_leaves_;
+  const SyncPolicy policy_;
+  const std::chrono::milliseconds interval_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  int fd_;             // current segment
+  uint64_t seq_;       // of current segment
+  uint64_t first_seq_;  // oldest segment not removed yet
+  size_t segment_size_;
+  std::string buffer_;  // records not written yet
+  uint64_t appended_lsn_;
+  uint64_t durable_lsn_;
+  bool syncing_;  // a leader is writing and syncing
+  std::unique_ptr<Job> job_;
+  bool stop_;
+  std::thread thread_;
+};
+
+std::vector<BPlusTree::Wal::Record> BPlusTree::Wal::Recover(
+    const std::string& path, int db_fd, uint64_t seq, const Options& options,
+    uint64_t* end_seq) {
+  // Segments before seq are covered by the db file already, a crash while
+  // removing them may have left the last ones behind.
+  for (uint64_t old_seq = seq; old_seq-- > 0;) {
+    if (unlink(SegmentPath(path, old_seq).c_str()) != 0) break;
+  }
+
+  std::vector<Record> records;
+  for (;; ++seq) {
+    int fd = open(SegmentPath(path, seq).c_str(), O_RDONLY);
+    if (fd == -1 && errno == ENOENT) break;
+    if (fd == -1) Exit("open");
+    std::string data;
+    char buf[kBufferSize];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) Exit("read");
+      data.append(buf, n);
+    }
+    close(fd);
+
+    // A torn tail ends the segment, a checkpoint counts only when its end
+    // record made it.
+    uint64_t magic;
+    if (data.size() < sizeof(magic)) continue;
+    std::memcpy(&magic, data.data(), sizeof(magic));
+    if (magic != kMagic) continue;
+    std::vector<Record> images;
+    size_t pos = sizeof(magic);
+    while (data.size() - pos >= kHeaderSize) {
+      uint32_t checksum, size, key_size;
+      std::memcpy(&checksum, &data[pos], sizeof(checksum));
+      std::memcpy(&size, &data[pos + sizeof(checksum)], sizeof(size));
+      if (size < 1 + sizeof(key_size) ||
+          data.size() - pos - kHeaderSize < size ||
+          Crc32(&data[pos + sizeof(checksum)], sizeof(size) + size) !=
+              checksum) {
+        break;
+      }
+      const char* payload = &data[pos + kHeaderSize];
+      std::memcpy(&key_size, &payload[1], sizeof(key_size));
+      if (key_size > size - 1 - sizeof(key_size)) break;
+      Record record;
+      record.type = static_cast<RecordType>(payload[0]);
+      record.key.assign(&payload[1 + sizeof(key_size)], key_size);
+      record.value.assign(&payload[1 + sizeof(key_size) + key_size],
+                          size - 1 - sizeof(key_size) - key_size);
+      pos += kHeaderSize + size;
+
+      switch (record.type) {
+        case kPut:
+        case kDelete:
+          records.push_back(std::move(record));
+          break;
+        case kBatch:
+          // Checksummed with the record, so operations are whole.
+          for (size_t i = 0; i < record.value.size();) {
+            const char* op = &record.value[i];
+            uint32_t sizes[2];
+            std::memcpy(sizes, &op[1], sizeof(sizes));
+            const char* key = &op[1 + sizeof(sizes)];
+            records.push_back(Record{static_cast<RecordType>(op[0]),
+                                     std::string(key, sizes[0]),
+                                     std::string(key + sizes[0], sizes[1])});
+            i += 1 + sizeof(sizes) + sizes[0] + sizes[1];
+          }
+          break;
+        case kCheckpointBegin:
+          images.clear();
+          break;
+        case kImage:
+          images.push_back(std::move(record));
+          break;
+        case kCheckpointEnd:
+          // Blocks hold every record logged before the checkpoint.
+          std::vector<std::tuple<off_t, const char*, size_t>> blocks;
+          for (const Record& image : images) {
+            off_t offset;
+            std::memcpy(&offset, image.key.data(), sizeof(offset));
+            blocks.emplace_back(offset, image.value.data(),
+                                image.value.size());
+          }
+          WriteBack(db_fd, blocks, EncodeLeaves(options));
+          images.clear();
+          records.clear();
+          break;
+      }
+    }
+  }
+  *end_seq = seq;
+  return records;
+}
+
+BPlusTree::Wal::Wal(const std::string& path, int db_fd, uint64_t first_seq,
+                    uint64_t seq, const Options& options)
+    : path_(path),
+      db_fd_(db_fd),
+      compress_leaves_(EncodeLeaves(options)),
+      policy_(options.sync_policy),
+      interval_(options.sync_interval_ms),
+      fd_(OpenSegment(seq)),
+      seq_(seq),
+      first_seq_(first_seq),
+      segment_size_(sizeof(kMagic)),
+      appended_lsn_(0),
+      durable_lsn_(0),
+      syncing_(false),
+      stop_(false),
+      thread_(&Wal::BackgroundWork, this) {}
+
+BPlusTree::Wal::~Wal() {
+  {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this] { return job_ == nullptr && !syncing_; });
+    FlushLocked(lock);
+    stop_ = true;
+    cv_.notify_all();
+  }
+  thread_.join();
+  if (fd_ != -1) close(fd_);
+}
+
+int BPlusTree::Wal::OpenSegment(uint64_t seq) {
+  std::string segment_path = SegmentPath(path_, seq);
+  int fd = open(segment_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if (fd == -1) Exit("open");
+  WriteAll(fd, reinterpret_cast<const char*>(&kMagic), sizeof(kMagic));
+  // The new file has to survive a crash as well as its records.
+  std::string dir = segment_path.substr(0, segment_path.rfind('/') + 1);
+  int dir_fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) Exit("open");
+  if (fsync(dir_fd) != 0) Exit("fsync");
+  close(dir_fd);
+  return fd;
+}
+
+uint64_t BPlusTree::Wal::Append(RecordType type, std::string_view key,
+                                std::string_view value) {
+  std::unique_lock<std::mutex> lock(mu_);
+  size_t size = buffer_.size();
+  Encode(&buffer_, type, key, value);
+  size = buffer_.size() - size;
+  segment_size_ += size;
+  appended_lsn_ += size;
+  if (buffer_.size() >= kBufferSize && !syncing_) FlushLocked(lock);
+  return appended_lsn_;
+}
+
+// Write buffered records to the current segment, caller holds mu_ and no
+// leader is syncing.
+void BPlusTree::Wal::FlushLocked(std::unique_lock<std::mutex>& lock) {
+  assert(lock.owns_lock());
+  assert(!syncing_);
+  WriteAll(fd_, buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
+
+void BPlusTree::Wal::Sync(uint64_t lsn) {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (durable_lsn_ < lsn) {
+    if (syncing_) {
+      cv_.wait(lock);
+      continue;
+    }
+    // Become the leader and commit everything appended so far.
+    syncing_ = true;
+    std::string buffer;
+    buffer.swap(buffer_);
+    uint64_t target = appended_lsn_;
+    int fd = fd_;
+    lock.unlock();
+    WriteAll(fd, buffer.data(), buffer.size());
+    if (fdatasync(fd) != 0) Exit("fdatasync");
+    lock.lock();
+    durable_lsn_ = target;
+    syncing_ = false;
+    cv_.notify_all();
+  }
+}
+
+void BPlusTree::Wal::StartCheckpoint(Checkpoint* checkpoint, bool closing,
+                                     bool wait) {
+  Job* job = new Job();
+  job->checkpoint.reset(checkpoint);
+  std::string begin, end;
+  Encode(&begin, kCheckpointBegin, {}, {});
+  Encode(&end, kCheckpointEnd, {}, {});
+  checkpoint->records.insert(0, begin);
+  for (auto& image : checkpoint->images) image.pos += begin.size();
+  checkpoint->records.append(end);
+
+  std::unique_lock<std::mutex> lock(mu_);
+  cv_.wait(lock, [this] { return job_ == nullptr && !syncing_; });
+  // Later syncs go to the new segment, so sync the closed one now.
+  FlushLocked(lock);
+  if (policy_ != SyncPolicy::kNone && durable_lsn_ < appended_lsn_ &&
+      fdatasync(fd_) != 0) {
+    Exit("fdatasync");
+  }
+  durable_lsn_ = appended_lsn_;
+  job->fd = fd_;
+  job->first_seq = first_seq_;
+  job->last_seq = seq_;
+  first_seq_ = seq_ + 1;
+  if (closing) {
+    fd_ = -1;
+  } else {
+    fd_ = OpenSegment(++seq_);
+    segment_size_ = sizeof(kMagic);
+  }
+
+  if (wait) {
+    lock.unlock();
+    RunJob(job);
+    delete job;
+    return;
+  }
+  job_.reset(job);
+  cv_.notify_all();
+}
+
+void BPlusTree::Wal::RunJob(Job* job) {
+  const Checkpoint& checkpoint = *job->checkpoint;
+  WriteAll(job->fd, checkpoint.records.data(), checkpoint.records.size());
+  if (fdatasync(job->fd) != 0) Exit("fdatasync");
+  close(job->fd);
+
+  std::vector<std::tuple<off_t, const char*, size_t>> blocks;
+  for (const auto& image : checkpoint.images) {
+    blocks.emplace_back(image.offset, &checkpoint.records[image.pos],
+                        image.size);
+  }
+  WriteBack(db_fd_, blocks, compress_leaves_);
+
+  for (uint64_t seq = job->first_seq; seq <= job->last_seq; ++seq) {
+    unlink(SegmentPath(path_, seq).c_str());
+  }
+}
+
+void BPlusTree::Wal::BackgroundWork() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!stop_) {
+    if (job_ != nullptr) {
+      lock.unlock();
+      RunJob(job_.get());
+      lock.lock();
+      job_.reset();
+      cv_.notify_all();
+      continue;
+    }
+    if (policy_ != SyncPolicy::kInterval) {
+      cv_.wait(lock);
+      continue;
+    }
+    cv_.wait_for(lock, interval_);
+    if (appended_lsn_ > durable_lsn_ && fd_ != -1) {
+      uint64_t lsn = appended_lsn_;
+      lock.unlock();
+      Sync(lsn);
+      lock.lock();
+    }
+  }
+}
+
+BPlusTree::BPlusTree(const char* path, const Options& options)
+    : fd_(open(path, O_CREAT | O_RDWR, 0600)),
+      tracer_(nullptr),
+      wal_(nullptr),
+      checkpoint_size_(options.checkpoint_size),
+      root_seq_(0),
+      last_leaf_(0),
+      rightmost_path_(false),
+      compact_level_(0) {
+  static_assert(sizeof(LeafNode) == kLeafNodeSize &&
+                    sizeof(IndexNode) == kIndexNodeSize,
+                "Nodes should fill whole pages.");
+  if (fd_ == -1) Exit("open");
+  std::vector<Wal::Record> records;
+  uint64_t first_seq = 0, end_seq = 0;
+  if (options.use_wal) {
+    // Bring the file up to the last checkpoint before mapping anything.
+    Meta meta;
+    ssize_t n = pread(fd_, &meta, sizeof(meta), kMetaOffset);
+    if (n < 0) Exit("pread");
+    if (n == sizeof(meta)) first_seq = meta.wal_seq;
+    records = Wal::Recover(path, fd_, first_seq, options, &end_seq);
+  }
+
+#ifdef BPLUS_TREE_TRACE
+  tracer_ = new Tracer();
+#endif
+  block_cache_ = new BlockCache(fd_, options, tracer_);
+  meta_ = Map<Meta>(kMetaOffset);
+  if (meta_->height == 0) {
+    // Initialize B+tree;
+    constexpr off_t of_root = kMetaOffset + kPageSize;
+    meta_->page_size = kPageSize;
+    LeafNode* root = new (Map<LeafNode>(of_root)) LeafNode();
+    root->offset = of_root;
+    SetRoot(of_root, 1);
+    meta_->block = of_root + sizeof(LeafNode);
+    meta_->blocks[LeafNode::kSizeClass] = 1;
+    UnMap<LeafNode>(root);
+    UnlockAll();
+  } else {
+    if (meta_->page_size != kPageSize) {
+      errno = EINVAL;
+      Exit("page size");
+    }
+    if (meta_->encoded_leaves != 0 && !EncodeLeaves(options)) {
+      errno = EINVAL;
+      Exit("compress_leaves");
+    }
+    LoadFreeList();
+  }
+  if (EncodeLeaves(options)) meta_->encoded_leaves = 1;
+  if (!options.use_wal) return;
+
+  for (const Wal::Record& record : records) {
+    if (record.type == Wal::kPut) {
+      Put(record.key, record.value);
+    } else {
+      Delete(record.key);
+    }
+  }
+  wal_ = new Wal(path, fd_, first_seq, end_seq, options);
+  // Replayed segments are removed once a checkpoint covers them.
+  if (first_seq != end_seq) Checkpoint(false);
+}
+
+BPlusTree::~BPlusTree() {
+  SaveFreeList();
+  if (wal_ != nullptr) {
+    Checkpoint(true);
+    delete wal_;
+  }
+  UnMap(meta_);
+  delete block_cache_;
+  delete tracer_;
+  close(fd_);
+}
+
+bool BPlusTree::Put(std::string_view key, std::string_view value) {
+  if (key.size() > kMaxKeySize ||
+      LeafNode::RecordSize(key, value) > LeafNode::kMaxRecordSize) {
+    return false;
+  }
+
+  TRACE_SCOPE(tracer_, kPut);
+  uint64_t lsn = 0;
+  {
+    std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+    // Update or insert in place with only the leaf locked.
+    LeafNode* leaf_node = LockLeaf(key);
+    int index = UpperBound(leaf_node, key);
+    bool done;
+    if (index > 0 && leaf_node->Key(index - 1) == key) {
+      size_t old_size = leaf_node->Value(index - 1).size();
+      done = leaf_node->UpdateValue(index - 1, value);
+      if (done) meta_->record_bytes += value.size() - old_size;
+    } else if ((done = leaf_node->CanInsert(key, value))) {
+      leaf_node->InsertKVAtIndex(index, key, value);
+      ++meta_->size;
+      meta_->record_bytes += LeafNode::RecordSize(key, value);
+    }
+    if (done && wal_ != nullptr) lsn = wal_->Append(Wal::kPut, key, value);
+    leaf_node->WriteUnlock();
+    UnMap(leaf_node);
+
+    if (!done) {
+      // The leaf has to split.
+      TRACE_SCOPE(tracer_, kStructureChange);
+      std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+      Insert(key, value);
+      if (wal_ != nullptr) lsn = wal_->Append(Wal::kPut, key, value);
+      UnlockAll();
+    }
+  }
+  if (wal_ != nullptr) Commit(lsn);
+  return true;
+}
+
+bool BPlusTree::Delete(std::string_view key) {
+  TRACE_SCOPE(tracer_, kDelete);
+  uint64_t lsn = 0;
+  bool found;
+  {
+    std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+    // Delete in place with only the leaf locked if it does not underflow.
+    LeafNode* leaf_node = LockLeaf(key);
+    int index = GetIndexFromLeafNode(leaf_node, key);
+    found = index != -1;
+    // Only the root leaf has no siblings.
+    bool done = !found ||
+                (leaf_node->left == 0 && leaf_node->right == 0) ||
+                leaf_node->UsedSize() - leaf_node->RecordSize(index) >=
+                    LeafNode::kMinUsedSize;
+    if (found && done) {
+      meta_->record_bytes -= leaf_node->RecordSize(index);
+      leaf_node->DeleteKVAtIndex(index);
+      --meta_->size;
+      if (wal_ != nullptr) lsn = wal_->Append(Wal::kDelete, key, {});
+    }
+    leaf_node->WriteUnlock();
+    UnMap(leaf_node);
+
+    if (!done) {
+      // The leaf has to borrow or merge.
+      TRACE_SCOPE(tracer_, kStructureChange);
+      std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+      found = Remove(key);
+      if (found && wal_ != nullptr) lsn = wal_->Append(Wal::kDelete, key, {});
+      UnlockAll();
+    }
+  }
+  if (found && wal_ != nullptr) Commit(lsn);
+  return found;
+}
+
+bool BPlusTree::Apply(const WriteBatch& batch) {
+  for (const WriteBatch::Op& op : batch.ops_) {
+    if (op.key.size() > kMaxKeySize ||
+        (op.put && LeafNode::RecordSize(op.key, op.value) >
+                       LeafNode::kMaxRecordSize)) {
+      return false;
+    }
+  }
+
+  // Sort by key and keep the last operation on each key.
+  std::vector<const WriteBatch::Op*> ops;
+  ops.reserve(batch.ops_.size());
+  for (const WriteBatch::Op& op : batch.ops_) ops.push_back(&op);
+  std::stable_sort(ops.begin(), ops.end(),
+                   [](const WriteBatch::Op* a, const WriteBatch::Op* b) {
+                     return a->key < b->key;
+                   });
+  size_t n = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    if (i + 1 < ops.size() && ops[i + 1]->key == ops[i]->key) continue;
+    ops[n++] = ops[i];
+  }
+  ops.resize(n);
+  if (ops.empty()) return true;
+
+  uint64_t lsn = 0;
+  {
+    TRACE_SCOPE(tracer_, kStructureChange);
+    std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+    std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+    std::string upper;
+    for (size_t begin = 0, end; begin < ops.size(); begin = end) {
+      // Keys below the separator above the leaf of the first key all go to
+      // that leaf.
+      off_t of_leaf = GetLeafOffset(ops[begin]->key, &upper);
+      for (end = begin + 1; end < ops.size(); ++end) {
+        if (!upper.empty() && ops[end]->key >= upper) break;
+      }
+      ApplyToLeaf(Map<LeafNode>(of_leaf),
+                  std::span(ops).subspan(begin, end - begin));
+    }
+    if (wal_ != nullptr) {
+      std::string data;
+      for (const WriteBatch::Op* op : ops) {
+        Wal::AddToBatch(&data, op->put ? Wal::kPut : Wal::kDelete, op->key,
+                        op->value);
+      }
+      lsn = wal_->Append(Wal::kBatch, {}, data);
+    }
+    UnlockAll();
+  }
+  if (wal_ != nullptr) Commit(lsn);
+  return true;
+}
+
+void BPlusTree::Commit(uint64_t lsn) {
+  {
+    TRACE_SCOPE(tracer_, kCommit);
+    wal_->Commit(lsn);
+  }
+  if ((wal_->SegmentSize() >= checkpoint_size_ ||
+       block_cache_->DirtySize() >= checkpoint_size_) &&
+      !wal_->CheckpointRunning()) {
+    Checkpoint(false);
+  }
+}
+
+// Capture dirty blocks and write them back, in the background unless closing.
+void BPlusTree::Checkpoint(bool closing) {
+  std::lock_guard<std::shared_mutex> lock(checkpoint_mutex_);
+  CheckpointLocked(closing, closing);
+}
+
+void BPlusTree::CheckpointLocked(bool closing, bool wait) {
+  TRACE_SCOPE(tracer_, kCheckpoint);
+  wal_->WaitCheckpoint();
+  block_cache_->ReleaseFlushed();
+  // The checkpoint covers the current segment. meta_ stays mapped, so map it
+  // again to mark it dirty.
+  meta_->wal_seq = wal_->Seq() + 1;
+  UnMap(Map<Meta>(kMetaOffset));
+  Wal::Checkpoint* checkpoint = new Wal::Checkpoint();
+  block_cache_->CaptureDirty([checkpoint](off_t offset, const void* block,
+                                          size_t size) {
+    checkpoint->AddImage(offset, block, size);
+  });
+  wal_->StartCheckpoint(checkpoint, closing, wait);
+  if (wait) block_cache_->ReleaseFlushed();
+}
+
+bool BPlusTree::Compact(size_t max_nodes) {
+  {
+    std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+    std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+    for (size_t i = 0; i < max_nodes && compact_level_ < meta_->height; ++i) {
+      GetLeafOffset(compact_key_);
+      off_t offset = path_[compact_level_];
+      bool more = compact_level_ == 0
+                      ? Relocate<LeafNode>(offset, &compact_key_)
+                      : Relocate<IndexNode>(offset, &compact_key_);
+      UnlockAll();
+      if (!more) {
+        ++compact_level_;
+        compact_key_.clear();
+      }
+    }
+    if (compact_level_ < meta_->height) return false;
+    compact_level_ = 0;
+  }
+
+  // Cut off the free blocks at the end of the file. With the log on, the db
+  // file must not lose them before its meta block says so.
+  std::lock_guard<std::shared_mutex> lock(checkpoint_mutex_);
+  std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+  off_t end = meta_->block;
+  for (;;) {
+    if (free_blocks_[LeafNode::kSizeClass].erase(meta_->block -
+                                                 sizeof(LeafNode)) != 0) {
+      meta_->block -= sizeof(LeafNode);
+      --meta_->blocks[LeafNode::kSizeClass];
+    } else if (free_blocks_[IndexNode::kSizeClass].erase(
+                   meta_->block - sizeof(IndexNode)) != 0) {
+      meta_->block -= sizeof(IndexNode);
+      --meta_->blocks[IndexNode::kSizeClass];
+    } else {
+      break;
+    }
+  }
+  if (meta_->block == end) return true;
+  if (wal_ != nullptr) CheckpointLocked(false, true);
+  block_cache_->Truncate(meta_->block);
+  return true;
+}
+
+bool BPlusTree::BulkLoad(
+    const std::function<bool(std::string* key, std::string* value)>& next,
+    double fill_factor) {
+  if (!Empty() || meta_->height != 1) return false;
+
+  // With the log on, dirty blocks stay in memory until a checkpoint, so write
+  // them back every checkpoint_size bytes. node is captured as it is, map it
+  // again so that later changes are captured too.
+  auto maybe_checkpoint = [this]<typename T>(T*& node) {
+    if (wal_ == nullptr || block_cache_->DirtySize() < checkpoint_size_) return;
+    off_t offset = node->offset;
+    UnMap(node);
+    Checkpoint(false);
+    node = block_cache_->Get<T>(offset, true);
+  };
+
+  // 1. Pack sorted records into leaves. levels holds the nodes of the level
+  // just built with the key that separates each from the one before it.
+  std::vector<std::pair<off_t, std::string>> level;
+  std::string key, value, last_key;
+  const size_t leaf_limit = LeafNode::kDataSize * fill_factor;
+  LeafNode* leaf_node = nullptr;
+  size_t count = 0, bytes = 0;
+  bool ok = true;
+  while (next(&key, &value)) {
+    if (key.size() > kMaxKeySize ||
+        LeafNode::RecordSize(key, value) > LeafNode::kMaxRecordSize ||
+        (leaf_node != nullptr && key <= last_key)) {
+      ok = false;
+      break;
+    }
+    if (leaf_node == nullptr) {
+      leaf_node = AllocAtEnd<LeafNode>();
+      level.emplace_back(leaf_node->offset, std::string());
+    } else if (leaf_node->UsedSize() + LeafNode::RecordSize(key, value) >
+                   leaf_limit ||
+               !leaf_node->CanInsert(key, value)) {
+      LeafNode* split_node = AllocAtEnd<LeafNode>();
+      split_node->left = leaf_node->offset;
+      leaf_node->right = split_node->offset;
+      level.emplace_back(split_node->offset, Separator(last_key, key));
+      leaf_node->Compact();
+      UnMap(leaf_node);
+      leaf_node = split_node;
+      maybe_checkpoint(leaf_node);
+    }
+    leaf_node->InsertKVAtIndex(leaf_node->count, key, value);
+    bytes += LeafNode::RecordSize(key, value);
+    last_key.swap(key);
+    ++count;
+  }
+  if (leaf_node == nullptr) return ok;
+  leaf_node->Compact();
+  UnMap(leaf_node);
+
+  // 2. Build index nodes bottom-up, one level at a time, until one node is
+  // left. An index node gets at least two childs.
+  const size_t index_limit = IndexNode::kDataSize * fill_factor;
+  size_t height = 1;
+  for (; level.size() > 1; ++height) {
+    std::vector<std::pair<off_t, std::string>> parents;
+    IndexNode* index_node = nullptr;
+    for (const auto& [of_child, separator] : level) {
+      if (index_node != nullptr &&
+          (index_node->count == 0 ||
+           (index_node->UsedSize() + sizeof(IndexNode::Slot) +
+                    index_node->KeyCost(separator) <=
+                index_limit &&
+            index_node->CanInsert(separator)))) {
+        index_node->InsertIndexAtIndex(index_node->count, separator,
+                                       index_node->Child(index_node->count));
+        index_node->UpdateOffset(index_node->count, of_child);
+      } else {
+        IndexNode* split_node = AllocAtEnd<IndexNode>();
+        split_node->level = height;
+        split_node->UpdateOffset(0, of_child);
+        if (index_node != nullptr) {
+          split_node->left = index_node->offset;
+          index_node->right = split_node->offset;
+          UnMap(index_node);
+        }
+        parents.emplace_back(split_node->offset, separator);
+        index_node = split_node;
+      }
+      maybe_checkpoint(index_node);
+    }
+
+    if (index_node->count == 0 && parents.size() > 1) {
+      // The last node got a single child, move the last child of the node
+      // before it over.
+      IndexNode* left_node =
+          block_cache_->Get<IndexNode>(index_node->left, true);
+      std::string separator = left_node->LastKey();
+      off_t of_child = left_node->Child(left_node->count);
+      left_node->DeleteLastKey();
+      UnMap(left_node);
+      index_node->InsertIndexAtIndex(0, parents.back().second, of_child);
+      parents.back().second = separator;
+    }
+    UnMap(index_node);
+    level.swap(parents);
+  }
+
+  // 3. Replace the empty root.
+  {
+    std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+    std::lock_guard<std::mutex> smo_lock(smo_mutex_);
+    LeafNode* root = Map<LeafNode>(meta_->root);
+    SetRoot(level[0].first, height);
+    meta_->size += count;
+    meta_->record_bytes += bytes;
+    Dealloc(root);
+    UnlockAll();
+  }
+  if (wal_ != nullptr) {
+    // Nothing was logged, the tree is only durable once written back.
+    Checkpoint(false);
+    wal_->WaitCheckpoint();
+  }
+  return ok;
+}
+
+void BPlusTree::Insert(std::string_view key, std::string_view value) {
+  // 1. Find Leaf node, an append to the rightmost leaf takes the path the last
+  // one left behind.
+  LeafNode* leaf_node = nullptr;
+  if (rightmost_path_) {
+    leaf_node = Map<LeafNode>(path_[0]);
+    if (leaf_node->count == 0 || key < leaf_node->FirstKey()) {
+      UnMap(leaf_node);
+      leaf_node = nullptr;
+    }
+  }
+  if (leaf_node == nullptr) leaf_node = Map<LeafNode>(GetLeafOffset(key));
+  int index = UpperBound(leaf_node, key);
+  if (index > 0 && leaf_node->Key(index - 1) == key) {
+    // 2. Update value of an existing key if it still fits, or remove it and
+    // insert it again.
+    size_t old_size = leaf_node->Value(index - 1).size();
+    if (leaf_node->UpdateValue(index - 1, value)) {
+      meta_->record_bytes += value.size() - old_size;
+      RememberRightmost(leaf_node);
+      UnMap(leaf_node);
+      return;
+    }
+    meta_->record_bytes -= leaf_node->RecordSize(--index);
+    leaf_node->DeleteKVAtIndex(index);
+    --meta_->size;
+  }
+
+  ++meta_->size;
+  meta_->record_bytes += LeafNode::RecordSize(key, value);
+  if (leaf_node->CanInsert(key, value)) {
+    // 3. If record fits in leaf node then finish.
+    leaf_node->InsertKVAtIndex(index, key, value);
+    RememberRightmost(leaf_node);
+    UnMap(leaf_node);
+    return;
+  }
+
+  // 4. Split leaf node to two leaf nodes and insert record into one of them.
+  bool append =
+      leaf_node->right == 0 && index == static_cast<int>(leaf_node->count);
+  LeafNode* split_node = SplitLeafNode(leaf_node, append);
+  if (split_node->count > 0 && key < split_node->FirstKey()) {
+    leaf_node->InsertKVAtIndex(index, key, value);
+  } else {
+    split_node->InsertKVAtIndex(index - leaf_node->count, key, value);
+  }
+
+  // 5. Insert the shortest key separating both halves to parent, split index
+  // nodes from bottom to up while they are full.
+  InsertKeyIntoParent(leaf_node,
+                      Separator(leaf_node->LastKey(), split_node->FirstKey()),
+                      split_node);
+  // path_ leads to leaf_node, split_node has the same parent.
+  path_[0] = split_node->offset;
+  RememberRightmost(split_node);
+  UnMap(leaf_node);
+  UnMap(split_node);
+  return;
+}
+
+void BPlusTree::RememberRightmost(const LeafNode* leaf_node) {
+  rightmost_path_ = leaf_node->right == 0 && path_[0] == leaf_node->offset;
+  if (rightmost_path_) {
+    last_leaf_.store(leaf_node->offset, std::memory_order_relaxed);
+  }
+}
+
+void BPlusTree::ApplyToLeaf(LeafNode* leaf_node,
+                            std::span<const WriteBatch::Op* const> ops) {
+  // 1. Apply operations in place while records fit.
+  size_t i = 0;
+  for (; i < ops.size(); ++i) {
+    const WriteBatch::Op& op = *ops[i];
+    int index = UpperBound(leaf_node, op.key);
+    bool found = index > 0 && leaf_node->Key(index - 1) == op.key;
+    if (!op.put) {
+      if (found) {
+        meta_->record_bytes -= leaf_node->RecordSize(index - 1);
+        leaf_node->DeleteKVAtIndex(index - 1);
+        --meta_->size;
+      }
+    } else if (found) {
+      size_t old_size = leaf_node->Value(index - 1).size();
+      if (!leaf_node->UpdateValue(index - 1, op.value)) break;
+      meta_->record_bytes += op.value.size() - old_size;
+    } else if (leaf_node->CanInsert(op.key, op.value)) {
+      leaf_node->InsertKVAtIndex(index, op.key, op.value);
+      ++meta_->size;
+      meta_->record_bytes += LeafNode::RecordSize(op.key, op.value);
+    } else {
+      break;
+    }
+  }
+
+  bool split = false;
+  if (i < ops.size()) {
+    // 2. Merge the rest with the records of leaf_node.
+    bool append = leaf_node->right == 0 &&
+                  (leaf_node->count == 0 || ops[i]->key > leaf_node->LastKey());
+    std::vector<std::pair<std::string, std::string>> old;
+    old.reserve(leaf_node->count);
+    for (size_t j = 0; j < leaf_node->count; ++j) {
+      old.emplace_back(leaf_node->Key(j), leaf_node->Value(j));
+    }
+    std::vector<std::pair<std::string_view, std::string_view>> records;
+    records.reserve(old.size() + ops.size() - i);
+    size_t total = 0;
+    for (size_t j = 0; j < old.size() || i < ops.size();) {
+      if (i == ops.size() || (j < old.size() && old[j].first < ops[i]->key)) {
+        records.emplace_back(old[j].first, old[j].second);
+        total += LeafNode::RecordSize(old[j].first, old[j].second);
+        ++j;
+        continue;
+      }
+      const WriteBatch::Op& op = *ops[i++];
+      if (j < old.size() && old[j].first == op.key) {
+        meta_->record_bytes -=
+            LeafNode::RecordSize(old[j].first, old[j].second);
+        --meta_->size;
+        ++j;
+      }
+      if (op.put) {
+        records.emplace_back(op.key, op.value);
+        total += LeafNode::RecordSize(op.key, op.value);
+        meta_->record_bytes += LeafNode::RecordSize(op.key, op.value);
+        ++meta_->size;
+      }
+    }
+
+    // 3. Spread the records evenly over leaf_node and as many new leaves right
+    // to it as they need, each leaf keeps room for a record like a split
+    // leaves it. Appends fill every leaf instead, like their splits do.
+    const size_t max_used = LeafNode::kDataSize - LeafNode::kMaxRecordSize;
+    size_t leaves =
+        append ? records.size()
+               : std::max<size_t>(1, (total + max_used - 1) / max_used);
+    leaf_node->Clear();
+    LeafNode* node = leaf_node;
+    for (size_t r = 0;;) {
+      // Take the share of the bytes left, the last leaf takes all of them.
+      size_t share = append ? LeafNode::kDataSize : total / leaves, used = 0;
+      --leaves;
+      while (r < records.size() && (used < share || leaves == 0) &&
+             node->CanInsert(records[r].first, records[r].second)) {
+        auto [key, value] = records[r++];
+        node->InsertKVAtIndex(node->count, key, value);
+        used += LeafNode::RecordSize(key, value);
+      }
+      total -= used;
+      node->Compact();
+      if (r == records.size()) break;
+
+      TRACE_SCOPE(tracer_, kSplit);
+      CountAtLevel(&splits_, 0);
+      TRACE_EVENT(tracer_, kSplit, 0, node->offset);
+      LeafNode* split_node = Alloc<LeafNode>(node->offset);
+      split_node->left = node->offset;
+      split_node->right = node->right;
+      node->right = split_node->offset;
+      if (split_node->right != 0) {
+        LeafNode* new_sibling = Map<LeafNode>(split_node->right);
+        new_sibling->left = split_node->offset;
+        UnMap(new_sibling);
+      }
+      // path_ leads to node, the parent a split of the parent leaves node in
+      // is put on it.
+      path_[0] = node->offset;
+      InsertKeyIntoParent(node, Separator(node->LastKey(), records[r].first),
+                          split_node);
+      if (node != leaf_node) UnMap(node);
+      node = split_node;
+      split = true;
+    }
+    if (node != leaf_node) UnMap(node);
+  }
+
+  // 4. Borrow or merge if leaf_node lost too many records, a leaf that was
+  // split has its share.
+  if (split) {
+    UnMap(leaf_node);
+    return;
+  }
+  Rebalance(leaf_node, true);
+}
+
+bool BPlusTree::Remove(std::string_view key) {
+  off_t of_leaf = GetLeafOffset(key);
+  LeafNode* leaf_node = Map<LeafNode>(of_leaf);
+  // 1. Delete key from leaf node
+  int index = GetIndexFromLeafNode(leaf_node, key);
+  if (index == -1) {
+    UnMap(leaf_node);
+    return false;
+  }
+
+  meta_->record_bytes -= leaf_node->RecordSize(index);
+  leaf_node->DeleteKVAtIndex(index);
+  --meta_->size;
+  Rebalance(leaf_node, false);
+  return true;
+}
+
+// A batch may empty a leaf, so with merge_first a leaf merges if it can and
+// otherwise borrows until it is not underfull.
+void BPlusTree::Rebalance(LeafNode* leaf_node, bool merge_first) {
+  // 2. If leaf_node is root then return.
+  if (Parent(leaf_node) == 0) {
+    UnMap(leaf_node);
+    return;
+  }
+
+  // 3. If leaf_node is not underfull then return else execute step 4.
+  if (!leaf_node->Underfull()) {
+    UnMap(leaf_node);
+    return;
+  }
+
+  // 4. If borrow from siblings successfully then return else execute step 5.
+  if (!merge_first && BorrowFromLeafSibling(leaf_node)) {
+    UnMap(leaf_node);
+    return;
+  }
+
+  // 5. Merge two leaf nodes, leave leaf_node underfull if neither sibling
+  // fits into it.
+  if (!MergeLeaf(leaf_node)) {
+    while (merge_first && leaf_node->Underfull() &&
+           BorrowFromLeafSibling(leaf_node)) {
+    }
+    UnMap(leaf_node);
+    return;
+  }
+
+  IndexNode* index_node = Map<IndexNode>(Parent(leaf_node));
+  UnMap(leaf_node);
+
+  // 6. If index_node is not underfull then return or execute 7.
+  // 7. If one of siblings has enough keys then rotate a key through parent
+  // then return or execute 8.
+  // 8. Merge index_node and its sibling and the key between them in parent.
+  while (Parent(index_node) != 0 && index_node->Underfull() &&
+         !BorrowFromIndexSibling(index_node) && MergeIndex(index_node)) {
+    IndexNode* old_index_node = index_node;
+    index_node = Map<IndexNode>(Parent(old_index_node));
+    UnMap(old_index_node);
+  }
+
+  if (Parent(index_node) == 0 && index_node->count == 0) {
+    // 9. Root is removed, update new root and height.
+    path_.pop_back();
+    SetRoot(index_node->Child(0), meta_->height - 1);
+    Dealloc(index_node);
+    return;
+  }
+
+  UnMap(index_node);
+}
+
+// Pass the value of key to read() before the leaf is validated, read() may
+// see a torn value then and is called again.
+template <typename F>
+bool BPlusTree::Find(std::string_view key, F read) const {
+  TRACE_SCOPE(tracer_, kGet);
+  for (;;) {
+    uint64_t version;
+    const LeafNode* leaf_node = FindLeaf(key, false, &version);
+    if (leaf_node == nullptr) continue;
+    int index = GetIndexFromLeafNode(leaf_node, key);
+    bool found = index != -1 && read(leaf_node->Value(index));
+    bool valid = leaf_node->Validate(version);
+    UnMap(leaf_node);
+    if (valid) return found;
+  }
+}
+
+bool BPlusTree::Get(std::string_view key, std::string& value) const {
+  std::string copy;
+  if (!Find(key, [&](std::string_view found) {
+        copy.assign(found);
+        return true;
+      })) {
+    return false;
+  }
+  value.swap(copy);
+  return true;
+}
+
+bool BPlusTree::Get(std::string_view key, void* value, size_t size) const {
+  return Find(key, [=](std::string_view found) {
+    if (found.size() != size) return false;
+    std::memcpy(value, found.data(), size);
+    return true;
+  });
+}
+
+std::vector<std::optional<std::string>> BPlusTree::MultiGet(
+    std::span<const std::string_view> keys) const {
+  std::vector<std::optional<std::string>> values(keys.size());
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+  // Sorted keys order[begin, end) route through node, read at version.
+  struct Group {
+    const Node* node;
+    uint64_t version;
+    size_t parent;  // in the level above
+    size_t begin;
+    size_t end;
+  };
+  std::vector<Group> groups, children;
+  std::vector<off_t> offsets;
+  // Positions in order whose descent ran into a writer, they are looked up
+  // one by one at the end.
+  std::vector<size_t> retry;
+  auto give_up = [&](const Group& group) {
+    for (size_t i = group.begin; i < group.end; ++i) retry.push_back(i);
+  };
+
+  // Load root and height together, see FindLeaf().
+  size_t height;
+  for (;;) {
+    uint64_t seq = root_seq_.load(std::memory_order_acquire);
+    off_t offset = meta_->root.load(std::memory_order_relaxed);
+    height = meta_->height.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((seq & 1) != 0 || root_seq_.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    const Node* node = height == 1
+                           ? static_cast<const Node*>(
+                                 block_cache_->Get<LeafNode>(offset, false))
+                           : Map<IndexNode>(offset);
+    uint64_t v;
+    if (node->ReadLock(&v) &&
+        root_seq_.load(std::memory_order_acquire) == seq) {
+      groups.push_back(Group{node, v, 0, 0, keys.size()});
+      break;
+    }
+    UnMap(node);
+  }
+
+  for (; height > 1; --height) {
+    // 1. Split the keys of every node among its children. The child offsets
+    // are only good if the node did not change meanwhile.
+    children.clear();
+    offsets.clear();
+    for (size_t g = 0; g < groups.size(); ++g) {
+      const Group& group = groups[g];
+      const IndexNode* index_node = static_cast<const IndexNode*>(group.node);
+      size_t first = children.size();
+      for (size_t i = group.begin; i < group.end; ++i) {
+        off_t of_child =
+            index_node->Child(UpperBound(index_node, keys[order[i]]));
+        if (children.size() > first && offsets.back() == of_child) {
+          children.back().end = i + 1;
+        } else {
+          children.push_back(Group{nullptr, 0, g, i, i + 1});
+          offsets.push_back(of_child);
+        }
+      }
+      if (!index_node->Validate(group.version)) {
+        give_up(group);
+        children.resize(first);
+        offsets.resize(first);
+      }
+    }
+
+    // 2. Map all children before searching any, so that reading them from
+    // the file and into the CPU cache overlaps.
+    bool leaves = height == 2;
+    if (leaves) {
+      block_cache_->Prefetch<LeafNode>(offsets);
+    } else {
+      block_cache_->Prefetch<IndexNode>(offsets);
+    }
+    for (size_t c = 0; c < children.size(); ++c) {
+      children[c].node = leaves ? static_cast<const Node*>(
+                                      block_cache_->Get<LeafNode>(offsets[c],
+                                                                  false))
+                                : Map<IndexNode>(offsets[c]);
+      PrefetchHead(children[c].node);
+    }
+
+    // 3. A child version is only good if its parent still points to it.
+    size_t kept = 0;
+    for (Group& child : children) {
+      const Group& parent = groups[child.parent];
+      if (!child.node->ReadLock(&child.version) ||
+          !parent.node->Validate(parent.version)) {
+        give_up(child);
+        UnMap(child.node);
+        continue;
+      }
+      children[kept++] = child;
+    }
+    children.resize(kept);
+    for (const Group& group : groups) UnMap(group.node);
+    groups.swap(children);
   }
 
-  leaf_node->DeleteKVAtIndex(index);
-  --meta_->size;
-  // 2. If leaf_node is root then return.
-  if (leaf_node->parent == 0) {
+  for (const Group& group : groups) {
+    const LeafNode* leaf_node = static_cast<const LeafNode*>(group.node);
+    for (size_t i = group.begin; i < group.end; ++i) {
+      int index = GetIndexFromLeafNode(leaf_node, keys[order[i]]);
+      if (index != -1) values[order[i]].emplace(leaf_node->Value(index));
+    }
+    if (!leaf_node->Validate(group.version)) {
+      for (size_t i = group.begin; i < group.end; ++i) values[order[i]].reset();
+      give_up(group);
+    }
     UnMap(leaf_node);
-    return true;
   }
 
-  // 3. If count of leaf_node >= GetMinKeys() then return else execute step 3.
-  if (leaf_node->count >= GetMinKeys()) {
-    UnMap(leaf_node);
-    return true;
+  for (size_t i : retry) {
+    std::string value;
+    if (Get(keys[order[i]], value)) values[order[i]] = std::move(value);
   }
+  return values;
+}
 
-  // 4. If borrow from siblings successfully then return else execute step 4.
-  if (BorrowFromLeafSibling(leaf_node)) {
-    UnMap<LeafNode>(leaf_node);
-    return true;
+template <typename T>
+T* BPlusTree::Map(off_t offset) {
+  T* block = block_cache_->Get<T>(offset, true);
+  if constexpr (std::is_base_of_v<Node, T>) {
+    if (std::find(smo_locked_.begin(), smo_locked_.end(), block) ==
+        smo_locked_.end()) {
+      // Keep it locked and mapped until UnlockAll().
+      block->WriteLock();
+      Preserve(offset, block, sizeof(T));
+      block_cache_->Get<T>(offset, true);
+      smo_locked_.push_back(block);
+    }
+  }
+  return block;
+}
+
+void BPlusTree::UnlockAll() {
+  for (Node* node : smo_locked_) {
+    node->WriteUnlock();
+    UnMap(node);
   }
+  smo_locked_.clear();
+}
 
-  // 5. Merge two leaf nodes.
-  leaf_node = MergeLeaf(leaf_node);
+// Readers load root and height together, see FindLeaf().
+void BPlusTree::SetRoot(off_t root, size_t height) {
+  TRACE_EVENT(tracer_, kRootChange, height - 1, root);
+  rightmost_path_ = false;
+  uint64_t seq = root_seq_.load(std::memory_order_relaxed);
+  root_seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  meta_->root.store(root, std::memory_order_relaxed);
+  meta_->height.store(height, std::memory_order_relaxed);
+  root_seq_.store(seq + 2, std::memory_order_release);
+}
 
-  IndexNode* index_node = Map<IndexNode>(leaf_node->parent);
-  UnMap<LeafNode>(leaf_node);
+off_t BPlusTree::Parent(const Node* node) const {
+  assert(node->level < path_.size() && path_[node->level] == node->offset);
+  return node->level + 1 < path_.size() ? path_[node->level + 1] : 0;
+}
 
-  // 6. If count of index_node >= GetMinKeys() then return or execute 6.
-  // 7. If count of one of sibling > GetMinKeys() then swap its key and parent's
-  // key then return or execute 7.
-  while (index_node->parent != 0 && index_node->count < GetMinKeys() &&
-         !BorrowFromIndexSibling(index_node)) {
-    // 8. Merge index_node and its' parent and sibling.
-    IndexNode* old_index_node = MergeIndex(index_node);
-    index_node = Map<IndexNode>(old_index_node->parent);
-    UnMap(old_index_node);
+// Descend to the leaf for key without locking and return it with its version,
+// or nullptr if a writer got in the way.
+BPlusTree::LeafNode* BPlusTree::FindLeaf(std::string_view key, bool dirty,
+                                         uint64_t* version) const {
+  TRACE_SCOPE(tracer_, kDescend);
+  uint64_t seq = root_seq_.load(std::memory_order_acquire);
+  off_t offset = meta_->root.load(std::memory_order_relaxed);
+  size_t height = meta_->height.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if ((seq & 1) != 0 || root_seq_.load(std::memory_order_relaxed) != seq) {
+    return nullptr;
   }
 
-  if (index_node->parent == 0 && index_node->count == 0) {
-    // 9. Root is removed, update new root and height.
-    Node* new_root = Map<Node>(index_node->indexes[0].offset);
-    assert(new_root->left == 0);
-    assert(new_root->right == 0);
-    new_root->parent = 0;
-    meta_->root = new_root->offset;
-    --meta_->height;
-    UnMap(new_root);
-    Dealloc(index_node);
-    return true;
+  const Node* node = height == 1
+                         ? static_cast<const Node*>(
+                               block_cache_->Get<LeafNode>(offset, dirty))
+                         : Map<IndexNode>(offset);
+  uint64_t v;
+  // The root may have split before its version was read.
+  if (!node->ReadLock(&v) ||
+      root_seq_.load(std::memory_order_acquire) != seq) {
+    UnMap(node);
+    return nullptr;
+  }
+  while (height-- > 1) {
+    // The child offset is only good if node did not change meanwhile, and the
+    // child version only if node still points to it.
+    const IndexNode* index_node = static_cast<const IndexNode*>(node);
+    off_t of_child = index_node->Child(UpperBound(index_node, key));
+    if (!node->Validate(v)) {
+      UnMap(node);
+      return nullptr;
+    }
+    const Node* child_node =
+        height == 1 ? static_cast<const Node*>(
+                          block_cache_->Get<LeafNode>(of_child, dirty))
+                    : Map<IndexNode>(of_child);
+    uint64_t child_v;
+    bool valid = child_node->ReadLock(&child_v) && node->Validate(v);
+    UnMap(node);
+    if (!valid) {
+      UnMap(child_node);
+      return nullptr;
+    }
+    node = child_node;
+    v = child_v;
   }
+  *version = v;
+  return const_cast<LeafNode*>(static_cast<const LeafNode*>(node));
+}
 
-  UnMap<IndexNode>(index_node);
-  return true;
+// Descend to the leaf for key and write lock it.
+BPlusTree::LeafNode* BPlusTree::LockLeaf(std::string_view key) {
+  // Every key from the first key of the rightmost leaf on goes there, so
+  // appends of ascending keys skip the descent.
+  off_t of_last = last_leaf_.load(std::memory_order_relaxed);
+  if (of_last != 0) {
+    uint64_t version;
+    LeafNode* leaf_node = block_cache_->Get<LeafNode>(of_last, true);
+    if (leaf_node->ReadLock(&version) && leaf_node->level == 0 &&
+        leaf_node->right == 0 && leaf_node->Count() > 0 &&
+        key >= leaf_node->FirstKey() && leaf_node->Upgrade(version)) {
+      Preserve(leaf_node->offset, leaf_node, sizeof(LeafNode));
+      return leaf_node;
+    }
+    UnMap(leaf_node);
+  }
+
+  for (;;) {
+    uint64_t version;
+    LeafNode* leaf_node = FindLeaf(key, true, &version);
+    if (leaf_node == nullptr) continue;
+    if (leaf_node->Upgrade(version)) {
+      Preserve(leaf_node->offset, leaf_node, sizeof(LeafNode));
+      if (leaf_node->right == 0) {
+        last_leaf_.store(leaf_node->offset, std::memory_order_relaxed);
+      }
+      return leaf_node;
+    }
+    UnMap(leaf_node);
+  }
 }
 
-bool BPlusTree::Get(const std::string& key, std::string& value) const {
-  off_t of_leaf = GetLeafOffset(key.data());
-  LeafNode* leaf_node = Map<LeafNode>(of_leaf);
-  int index = GetIndexFromLeafNode(leaf_node, key.data());
-  if (index == -1) {
-    UnMap<LeafNode>(leaf_node);
-    return false;
+template <typename T>
+bool BPlusTree::Relocate(off_t offset, std::string* next) {
+  T* node = Map<T>(offset);
+  std::set<off_t>& free_blocks = free_blocks_[T::kSizeClass];
+  if (!free_blocks.empty() && *free_blocks.begin() < offset) {
+    // Copy node over the free block and point its parent and siblings to it.
+    // Readers that got to node before see it deallocated and start over.
+    off_t to = *free_blocks.begin();
+    free_blocks.erase(free_blocks.begin());
+    T* block = Map<T>(to);
+    uint64_t version = block->Version().load(std::memory_order_relaxed);
+    std::memcpy(static_cast<void*>(block), node, sizeof(T));
+    block->Version().store(version & ~Node::kObsolete,
+                           std::memory_order_relaxed);
+    block->offset = to;
+    off_t of_parent = Parent(node);
+    if (of_parent == 0) {
+      SetRoot(to, meta_->height);
+    } else {
+      IndexNode* parent_node = Map<IndexNode>(of_parent);
+      parent_node->UpdateOffset(GetIndexFromIndexNode(parent_node, offset), to);
+      UnMap(parent_node);
+    }
+    if (node->left != 0) {
+      T* sibling = Map<T>(node->left);
+      sibling->right = to;
+      UnMap(sibling);
+    }
+    if (node->right != 0) {
+      T* sibling = Map<T>(node->right);
+      sibling->left = to;
+      UnMap(sibling);
+    }
+    path_[node->level] = to;
+    TRACE_EVENT(tracer_, kRelocate, node->level, to);
+    Dealloc(node);
+    node = block;
   }
-  value = leaf_node->Value(index);
-  UnMap<LeafNode>(leaf_node);
-  return true;
+
+  bool more = node->right != 0;
+  if (more) {
+    const T* sibling = block_cache_->Get<T>(node->right, false);
+    if (std::find(smo_locked_.begin(), smo_locked_.end(), sibling) !=
+        smo_locked_.end()) {
+      // Locked above when node moved.
+      next->assign(sibling->FirstKey());
+    } else {
+      // Writers change leaves without smo_mutex_, read the first key of the
+      // sibling optimistically. It can not be deallocated meanwhile.
+      uint64_t version;
+      do {
+        sibling->ReadLock(&version);
+        next->assign(sibling->FirstKey());
+      } while (!sibling->Validate(version));
+    }
+    UnMap(sibling);
+  }
+  UnMap(node);
+  return more;
 }
 
 template <typename T>
-T* BPlusTree::Map(off_t offset) const {
-  return block_cache_->Get<T>(fd_, offset);
+const T* BPlusTree::Map(off_t offset) const {
+  return block_cache_->Get<T>(offset, false);
 }
 
 template <typename T>
-void BPlusTree::UnMap(T* map_obj) const {
+void BPlusTree::UnMap(const T* map_obj) const {
   block_cache_->Put<T>(map_obj);
 }
 
-constexpr size_t BPlusTree::GetMinKeys() const { return (kOrder + 1) / 2 - 1; }
-
-constexpr size_t BPlusTree::GetMaxKeys() const { return kOrder - 1; }
-
 BPlusTree::IndexNode* BPlusTree::GetOrCreateParent(Node* node) {
-  if (node->parent == 0) {
+  off_t of_parent = Parent(node);
+  if (of_parent == 0) {
     // Split root node.
-    IndexNode* parent_node = Alloc<IndexNode>();
-    node->parent = parent_node->offset;
-    meta_->root = parent_node->offset;
-    ++meta_->height;
+    IndexNode* parent_node = Alloc<IndexNode>(node->offset);
+    parent_node->level = node->level + 1;
+    path_.push_back(parent_node->offset);
+    SetRoot(parent_node->offset, meta_->height + 1);
     return parent_node;
   }
-  return Map<IndexNode>(node->parent);
+  return Map<IndexNode>(of_parent);
 }
 
-template <typename T>
-int BPlusTree::UpperBound(T arr[], int n, const char* key) const {
-  assert(n <= GetMaxKeys());
-  int l = 0, r = n - 1;
-  while (l <= r) {
+// Index of the first of n slots whose head is greater than head, or not less
+// than head unless kUpper. The loop does not branch on heads.
+template <bool kUpper, typename Slot>
+int HeadBound(const Slot* slots, int n, uint32_t head) {
+  if (n == 0) return 0;
+  const Slot* base = slots;
+  while (n > 1) {
+    int half = n >> 1;
+    uint32_t h = base[half - 1].head;
+    base += (kUpper ? h <= head : h < head) ? half : 0;
+    n -= half;
+  }
+  uint32_t h = base->head;
+  return base - slots + (kUpper ? h <= head : h < head);
+}
+
+// Index of the first key in node greater than key, or not less than key
+// unless kUpper. Compare the prefix shared by all keys once, then the heads
+// of the suffixes, and only the suffixes whose head equals the one of key.
+template <bool kUpper, typename T>
+int Search(const T* node, std::string_view key) {
+  std::string_view prefix = node->Prefix();
+  int cmp = key.substr(0, prefix.size()).compare(prefix);
+  if (cmp < 0) return 0;
+  if (cmp > 0) return node->Count();
+  key.remove_prefix(prefix.size());
+  uint32_t head = KeyHead(key);
+  int l = HeadBound<false>(node->Slots(), node->Count(), head);
+  int r = HeadBound<true>(node->Slots(), node->Count(), head);
+  while (l < r) {
     int mid = (l + r) >> 1;
-    if (std::strncmp(arr[mid].key, key, kMaxKeySize) <= 0) {
+    int c = node->Suffix(mid).compare(key);
+    if (kUpper ? c <= 0 : c < 0) {
       l = mid + 1;
     } else {
-      r = mid - 1;
+      r = mid;
     }
   }
   return l;
 }
 
 template <typename T>
-int BPlusTree::LowerBound(T arr[], int n, const char* key) const {
-  assert(n <= GetMaxKeys());
-  int l = 0, r = n - 1;
-  while (l <= r) {
-    int mid = (l + r) >> 1;
-    if (std::strncmp(arr[mid].key, key, kMaxKeySize) < 0) {
-      l = mid + 1;
-    } else {
-      r = mid - 1;
+int BPlusTree::UpperBound(const T* node, std::string_view key) const {
+  return Search<true>(node, key);
+}
+
+template <typename T>
+int BPlusTree::LowerBound(const T* node, std::string_view key) const {
+  return Search<false>(node, key);
+}
+
+// Reuse the free block closest to hint so that related nodes stay close
+// in the db file, or append a new block if there is none.
+template <typename T>
+T* BPlusTree::Alloc(off_t hint) {
+  std::set<off_t>& free_blocks = free_blocks_[T::kSizeClass];
+  off_t offset = meta_->block;
+  if (!free_blocks.empty()) {
+    auto it = free_blocks.lower_bound(hint);
+    if (it == free_blocks.end() ||
+        (it != free_blocks.begin() && hint - *std::prev(it) < *it - hint)) {
+      --it;
     }
+    offset = *it;
+    free_blocks.erase(it);
+  } else {
+    meta_->block += sizeof(T);
+    ++meta_->blocks[T::kSizeClass];
   }
-  return l;
-};
+  // Keep counting versions of a reused block, readers may still look at it.
+  T* block = Map<T>(offset);
+  uint64_t version = block->Version().load(std::memory_order_relaxed);
+  T* node = new (block) T();
+  node->Version().store(version & ~Node::kObsolete, std::memory_order_relaxed);
+  node->offset = offset;
+  return node;
+}
 
 template <typename T>
-T* BPlusTree::Alloc() {
-  T* node = new (Map<T>(meta_->block)) T();
-  node->offset = meta_->block;
+T* BPlusTree::AllocAtEnd() {
+  off_t offset = meta_->block;
   meta_->block += sizeof(T);
+  ++meta_->blocks[T::kSizeClass];
+  T* block = block_cache_->Get<T>(offset, true);
+  uint64_t version = block->Version().load(std::memory_order_relaxed);
+  T* node = new (block) T();
+  node->Version().store(version & ~Node::kObsolete, std::memory_order_relaxed);
+  node->offset = offset;
   return node;
 }
 
 template <typename T>
 void BPlusTree::Dealloc(T* node) {
+  off_t of_last = node->offset;
+  last_leaf_.compare_exchange_strong(of_last, 0, std::memory_order_relaxed);
+  free_blocks_[T::kSizeClass].insert(node->offset);
+  node->Version().fetch_or(Node::kObsolete, std::memory_order_relaxed);
   UnMap<T>(node);
 }
 
-off_t BPlusTree::GetLeafOffset(const char* key) const {
+// Free blocks are only kept in memory while the db is open, the saved chains
+// are consumed here so that a crash can leak blocks but never hand out a
+// block twice.
+void BPlusTree::LoadFreeList() {
+  for (int i = 0; i < 2; ++i) {
+    off_t of_link = meta_->free_list[i];
+    while (of_link != 0) {
+      FreeListBlock* link = Map<FreeListBlock>(of_link);
+      free_blocks_[i].insert(link->blocks, link->blocks + link->count);
+      of_link = link->next;
+      free_blocks_[IndexNode::kSizeClass].insert(link->offset);
+      UnMap(link);
+    }
+    meta_->free_list[i] = 0;
+  }
+}
+
+void BPlusTree::SaveFreeList() {
+  static_assert(sizeof(FreeListBlock) <= sizeof(IndexNode),
+                "FreeListBlock should fit in an IndexNode block.");
+  // Links are recycled IndexNode blocks themselves, take them out of the
+  // free set before counting how many are needed.
+  std::vector<off_t> links;
+  auto links_needed = [&]() {
+    size_t n = 0;
+    for (int i = 0; i < 2; ++i) {
+      n += (free_blocks_[i].size() + FreeListBlock::kCapacity - 1) /
+           FreeListBlock::kCapacity;
+    }
+    return n;
+  };
+  std::set<off_t>& free_indexes = free_blocks_[IndexNode::kSizeClass];
+  while (links.size() < links_needed()) {
+    if (!free_indexes.empty()) {
+      links.push_back(*free_indexes.rbegin());
+      free_indexes.erase(std::prev(free_indexes.end()));
+    } else {
+      links.push_back(meta_->block);
+      meta_->block += sizeof(IndexNode);
+      ++meta_->blocks[IndexNode::kSizeClass];
+    }
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    meta_->free_list[i] = 0;
+    auto it = free_blocks_[i].begin();
+    while (it != free_blocks_[i].end()) {
+      FreeListBlock* link = Map<FreeListBlock>(links.back());
+      link->offset = links.back();
+      link->next = meta_->free_list[i];
+      link->count = 0;
+      links.pop_back();
+      while (it != free_blocks_[i].end() &&
+             link->count < FreeListBlock::kCapacity) {
+        link->blocks[link->count++] = *it++;
+      }
+      meta_->free_list[i] = link->offset;
+      UnMap(link);
+    }
+    free_blocks_[i].clear();
+  }
+
+  // Taking links out of the free set may leave one more link than needed,
+  // chain it empty so that it is recycled on open.
+  while (!links.empty()) {
+    FreeListBlock* link = Map<FreeListBlock>(links.back());
+    link->offset = links.back();
+    link->next = meta_->free_list[IndexNode::kSizeClass];
+    link->count = 0;
+    links.pop_back();
+    meta_->free_list[IndexNode::kSizeClass] = link->offset;
+    UnMap(link);
+  }
+}
+
+off_t BPlusTree::GetLeafOffset(std::string_view key, std::string* upper) {
+  TRACE_SCOPE(tracer_, kDescend);
   size_t height = meta_->height;
   off_t offset = meta_->root;
-  if (height <= 1) {
-    assert(height == 1);
-    return offset;
-  }
-  // 1. Find bottom index node.
-  IndexNode* index_node = Map<IndexNode>(offset);
-  while (--height > 1) {
-    int index = UpperBound(index_node->indexes, index_node->count, key);
-    off_t of_child = index_node->indexes[index].offset;
+  rightmost_path_ = false;
+  path_.resize(height);
+  path_[height - 1] = offset;
+  if (upper != nullptr) upper->clear();
+  while (--height > 0) {
+    const IndexNode* index_node = block_cache_->Get<IndexNode>(offset, false);
+    int index = UpperBound(index_node, key);
+    // A separator further down is tighter.
+    if (upper != nullptr && index < static_cast<int>(index_node->count)) {
+      *upper = index_node->Key(index);
+    }
+    offset = index_node->Child(index);
     UnMap(index_node);
-    index_node = Map<IndexNode>(of_child);
-    offset = of_child;
-  }
-  // 2. Get offset of leaf node.
-  int index = UpperBound(index_node->indexes, index_node->count, key);
-  off_t of_child = index_node->indexes[index].offset;
-  UnMap<IndexNode>(index_node);
-  return of_child;
-}
-
-inline size_t BPlusTree::InsertKeyIntoIndexNode(IndexNode* index_node,
-                                                const char* key,
-                                                Node* left_node,
-                                                Node* right_node) {
-  assert(index_node->count <= GetMaxKeys());
-  int index = UpperBound(index_node->indexes, index_node->count, key);
+    path_[height - 1] = offset;
+  }
+  return offset;
+}
+
+inline void BPlusTree::InsertKeyIntoIndexNode(IndexNode* index_node,
+                                              std::string_view key,
+                                              Node* left_node,
+                                              Node* right_node) {
+  int index = UpperBound(index_node, key);
   index_node->InsertIndexAtIndex(index, key, left_node->offset);
   index_node->UpdateOffset(index + 1, right_node->offset);
-  return index_node->count;
 }
 
-size_t BPlusTree::InsertKVIntoLeafNode(LeafNode* leaf_node, const char* key,
-                                       const char* value) {
-  assert(leaf_node->count <= GetMaxKeys());
-  int index = UpperBound(leaf_node->records, leaf_node->count, key);
-  if (index > 0 &&
-      std::strncmp(leaf_node->Key(index - 1), key, kMaxKeySize) == 0) {
-    leaf_node->UpdateValue(index - 1, value);
-    return leaf_node->count;
+void BPlusTree::InsertKeyIntoParent(Node* left_node, std::string_view key,
+                                    Node* right_node) {
+  IndexNode* parent_node = GetOrCreateParent(left_node);
+  if (parent_node->CanInsert(key)) {
+    InsertKeyIntoIndexNode(parent_node, key, left_node, right_node);
+    UnMap(parent_node);
+    return;
   }
 
-  leaf_node->InsertKVAtIndex(index, key, value);
-  ++meta_->size;
-  return leaf_node->count;
+  // Parent is full, split it and insert the middle key into the parent of
+  // parent, then try again with the half left_node belongs to. A short key
+  // may shrink the shared prefix of the half so much that it still does not
+  // fit, then the half is split again.
+  std::string mid_key;
+  bool append = parent_node->right == 0 &&
+                UpperBound(parent_node, key) ==
+                    static_cast<int>(parent_node->count);
+  IndexNode* split_node = SplitIndexNode(parent_node, &mid_key, append);
+  InsertKeyIntoParent(parent_node, mid_key, split_node);
+  // key lies in the range of left_node, so it falls on the same side of
+  // mid_key as all of left_node.
+  if (key > mid_key) path_[left_node->level + 1] = split_node->offset;
+  UnMap(parent_node);
+  UnMap(split_node);
+  InsertKeyIntoParent(left_node, key, right_node);
 }
 
-BPlusTree::LeafNode* BPlusTree::SplitLeafNode(LeafNode* leaf_node) {
-  assert(leaf_node->count == kOrder);
-  constexpr int mid = (kOrder - 1) >> 1;
-  constexpr int left_count = mid;
-  constexpr int right_count = kOrder - mid;
-
-  LeafNode* split_node = Alloc<LeafNode>();
+BPlusTree::LeafNode* BPlusTree::SplitLeafNode(LeafNode* leaf_node,
+                                              bool append) {
+  // Split by bytes, the left half gets the first records that take at least
+  // half of used bytes. Near the middle, prefer the split point with the
+  // shortest separator to keep index nodes small, as long as both halves keep
+  // room for the record being inserted. An append keeps all records on the
+  // left, so that ascending keys leave full leaves behind.
+  assert(leaf_node->count >= 2);
+  TRACE_SCOPE(tracer_, kSplit);
+  CountAtLevel(&splits_, 0);
+  TRACE_EVENT(tracer_, kSplit, 0, leaf_node->offset);
+  int count = leaf_node->count;
+  int mid = count;
+  if (!append) {
+    size_t total = leaf_node->UsedSize(), half = total / 2, used = 0;
+    const size_t max_used = LeafNode::kDataSize - LeafNode::kMaxRecordSize;
+    mid = 0;
+    while (used < half) used += leaf_node->RecordSize(mid++);
+    mid = std::max(1, std::min(mid, count - 1));
+    size_t best =
+        Separator(leaf_node->Key(mid - 1), leaf_node->Key(mid)).size();
+    used = 0;
+    for (int i = 1; i < count && used <= half + LeafNode::kSplitWindow; ++i) {
+      used += leaf_node->RecordSize(i - 1);
+      if (used + LeafNode::kSplitWindow < half || used > max_used ||
+          total - used > max_used) {
+        continue;
+      }
+      size_t size = Separator(leaf_node->Key(i - 1), leaf_node->Key(i)).size();
+      if (size < best) {
+        best = size;
+        mid = i;
+      }
+    }
+  }
 
-  // Change count.
-  leaf_node->count = left_count;
-  split_node->count = right_count;
+  LeafNode* split_node = Alloc<LeafNode>(leaf_node->offset);
 
-  // Copy right part of index_node.
-  std::memcpy(&split_node->records[0], &leaf_node->records[mid],
-              sizeof(split_node->records[0]) * right_count);
+  // Move right part of leaf_node.
+  leaf_node->MoveTail(mid, split_node);
 
   // Link siblings.
   split_node->left = leaf_node->offset;
@@ -659,29 +3870,40 @@ BPlusTree::LeafNode* BPlusTree::SplitLeafNode(LeafNode* leaf_node) {
   return split_node;
 }
 
-BPlusTree::IndexNode* BPlusTree::SplitIndexNode(IndexNode* index_node) {
-  assert(index_node->count == kOrder);
-  constexpr int mid = (kOrder - 1) >> 1;
-  constexpr int left_count = mid;
-  constexpr int right_count = kOrder - mid - 1;
-
-  IndexNode* split_node = Alloc<IndexNode>();
-
-  // Change count.
-  index_node->count = left_count;
-  split_node->count = right_count;
+BPlusTree::IndexNode* BPlusTree::SplitIndexNode(IndexNode* index_node,
+                                                std::string* mid_key,
+                                                bool append) {
+  // Split by bytes, the middle key moves up to parent. Near the middle, prefer
+  // the shortest key to move up. An append moves the last key up and leaves
+  // only the last child to the right.
+  assert(index_node->count >= 3);
+  TRACE_SCOPE(tracer_, kSplit);
+  CountAtLevel(&splits_, index_node->level);
+  TRACE_EVENT(tracer_, kSplit, index_node->level, index_node->offset);
+  int count = index_node->count;
+  int mid = count - 1;
+  if (!append) {
+    size_t half = index_node->UsedSize() / 2, used = 0;
+    mid = 0;
+    while (used < half) used += index_node->EntrySize(mid++);
+    mid = std::max(1, std::min(mid, count - 2));
+    used = 0;
+    for (int i = 0; i < count - 1 && used <= half + IndexNode::kSplitWindow;
+         ++i) {
+      used += index_node->EntrySize(i);
+      if (i == 0 || used + IndexNode::kSplitWindow < half) continue;
+      if (index_node->Suffix(i).size() < index_node->Suffix(mid).size()) {
+        mid = i;
+      }
+    }
+  }
 
-  // Copy right part of index_node.
-  std::memcpy(&split_node->indexes[0], &index_node->indexes[mid + 1],
-              sizeof(split_node->indexes[0]) * (right_count + 1));
+  IndexNode* split_node = Alloc<IndexNode>(index_node->offset);
+  split_node->level = index_node->level;
+  mid_key->assign(index_node->Key(mid));
 
-  // Link old childs to new splited parent.
-  for (int i = mid + 1; i <= kOrder; ++i) {
-    off_t of_child = index_node->indexes[i].offset;
-    LeafNode* child_node = Map<LeafNode>(of_child);
-    child_node->parent = split_node->offset;
-    UnMap(child_node);
-  }
+  // Move right part of index_node.
+  index_node->MoveTail(mid, split_node);
 
   // Link siblings.
   split_node->left = index_node->offset;
@@ -695,126 +3917,488 @@ BPlusTree::IndexNode* BPlusTree::SplitIndexNode(IndexNode* index_node) {
   return split_node;
 }
 
-inline int BPlusTree::GetIndexFromLeafNode(LeafNode* leaf_node,
-                                           const char* key) const {
-  int index = LowerBound(leaf_node->records, leaf_node->count, key);
-  return index < static_cast<int>(leaf_node->count) &&
-                 std::strncmp(leaf_node->Key(index), key, kMaxKeySize) == 0
+inline int BPlusTree::GetIndexFromLeafNode(const LeafNode* leaf_node,
+                                                 std::string_view key) const {
+  int index = LowerBound(leaf_node, key);
+  return index < leaf_node->Count() && leaf_node->Key(index) == key
              ? index
              : -1;
 }
 
-std::vector<std::pair<std::string, std::string>> BPlusTree::GetRange(
-    const std::string& left_key, const std::string& right_key) const {
-  std::vector<std::pair<std::string, std::string>> res;
-  off_t of_leaf = GetLeafOffset(left_key.data());
-  LeafNode* leaf_node = Map<LeafNode>(of_leaf);
-  int index = LowerBound(leaf_node->records, leaf_node->count, left_key.data());
-  for (int i = index; i < leaf_node->count; ++i) {
-    res.emplace_back(leaf_node->Key(i), leaf_node->Value(i));
-  }
-
-  of_leaf = leaf_node->right;
-  bool finish = false;
-  while (of_leaf != 0 && !finish) {
-    LeafNode* right_leaf_node = Map<LeafNode>(of_leaf);
-    for (int i = 0; i < right_leaf_node->count; ++i) {
-      if (strncmp(right_leaf_node->Key(i), right_key.data(), kMaxKeySize) <=
-          0) {
-        res.emplace_back(right_leaf_node->Key(i), right_leaf_node->Value(i));
+// Position of child in the slots of parent.
+int BPlusTree::GetIndexFromIndexNode(IndexNode* index_node,
+                                     off_t of_child) const {
+  for (size_t i = 0; i <= index_node->count; ++i) {
+    if (index_node->Child(i) == of_child) return i;
+  }
+  assert(false);
+  return -1;
+}
+
+// Root and height of the tree when the snapshot was taken, and the old
+// contents of the blocks that changed since.
+class BPlusTree::Snapshot {
+ public:
+  explicit Snapshot(BPlusTree* tree)
+      : tree_(tree),
+        root_(tree->meta_->root),
+        height_(tree->meta_->height),
+        end_(tree->meta_->block),
+        chunks_(new std::atomic<Chunk*>[ChunkCount()]()) {}
+
+  ~Snapshot() {
+    {
+      // Writers walk snapshots_ without a lock, see Preserve().
+      std::lock_guard<std::shared_mutex> lock(tree_->checkpoint_mutex_);
+      std::vector<Snapshot*>& snapshots = tree_->snapshots_;
+      snapshots.erase(std::find(snapshots.begin(), snapshots.end(), this));
+    }
+    for (size_t i = 0; i < ChunkCount(); ++i) {
+      Chunk* chunk = chunks_[i].load(std::memory_order_relaxed);
+      if (chunk == nullptr) continue;
+      for (std::atomic<Copy*>& copy : chunk->copies) {
+        delete copy.load(std::memory_order_relaxed);
+      }
+      delete chunk;
+    }
+  }
+
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  // Copy the node at offset as it was to node.
+  template <typename T>
+  void Read(off_t offset, T* node) const {
+    for (;;) {
+      const T* block = tree_->block_cache_->Get<T>(offset, false);
+      // Writers preserve a block while they hold its lock, so its copy is
+      // found once the lock is released, and the version changes before the
+      // block does otherwise. A deallocated block was preserved before.
+      uint64_t version;
+      block->ReadLock(&version);
+      const char* copy = Find(offset);
+      std::memcpy(static_cast<void*>(node),
+                  copy != nullptr ? copy : static_cast<const void*>(block),
+                  sizeof(T));
+      bool valid = copy != nullptr || block->Validate(version);
+      tree_->UnMap(block);
+      if (valid) return;
+    }
+  }
+
+  // Copy the leaf for key as it was to leaf_node.
+  void FindLeaf(std::string_view key, LeafNode* leaf_node) const {
+    off_t offset = root_;
+    if (height_ > 1) {
+      std::unique_ptr<IndexNode> index_node(new IndexNode());
+      for (size_t height = height_; height > 1; --height) {
+        Read(offset, index_node.get());
+        offset = index_node->Child(tree_->UpperBound(index_node.get(), key));
+      }
+    }
+    Read(offset, leaf_node);
+  }
+
+ private:
+  friend class BPlusTree;
+
+  // Blocks start on page boundaries, copies are found by page number in
+  // chunks allocated as blocks of them change.
+  static constexpr size_t kChunkPages = 512;
+  struct Copy {
+    // Shared by the snapshots that were taken before the block changed.
+    std::shared_ptr<char[]> block;
+  };
+  struct Chunk {
+    std::atomic<Copy*> copies[kChunkPages];
+  };
+
+  size_t ChunkCount() const {
+    return (end_ / kPageSize + kChunkPages - 1) / kChunkPages;
+  }
+
+  // Copy of the block at offset, or nullptr if it did not change. Slots are
+  // written once and freed with the snapshot, so readers do not lock.
+  const char* Find(off_t offset) const {
+    if (offset >= end_) return nullptr;
+    size_t page = offset / kPageSize;
+    const Chunk* chunk =
+        chunks_[page / kChunkPages].load(std::memory_order_acquire);
+    if (chunk == nullptr) return nullptr;
+    const Copy* copy =
+        chunk->copies[page % kChunkPages].load(std::memory_order_acquire);
+    return copy != nullptr ? copy->block.get() : nullptr;
+  }
+
+  // Publish the copy of the block at offset, the caller holds its lock and
+  // found no copy yet. Writers of blocks in the same chunk race to allocate
+  // it, the loser frees its own.
+  void Add(off_t offset, const std::shared_ptr<char[]>& block) {
+    size_t page = offset / kPageSize;
+    std::atomic<Chunk*>& slot = chunks_[page / kChunkPages];
+    Chunk* chunk = slot.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      Chunk* fresh = new Chunk();
+      if (slot.compare_exchange_strong(chunk, fresh,
+                                       std::memory_order_acq_rel)) {
+        chunk = fresh;
       } else {
-        finish = true;
-        break;
+        delete fresh;
       }
     }
-    of_leaf = right_leaf_node->right;
-    UnMap(right_leaf_node);
+    chunk->copies[page % kChunkPages].store(new Copy{block},
+                                            std::memory_order_release);
   }
 
-  UnMap(leaf_node);
+  BPlusTree* tree_;
+  const off_t root_;
+  const size_t height_;
+  const off_t end_;  // blocks from here on were allocated later
+  std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+};
+
+std::shared_ptr<const BPlusTree::Snapshot> BPlusTree::GetSnapshot() {
+  // No writer is halfway through a change meanwhile.
+  std::lock_guard<std::shared_mutex> lock(checkpoint_mutex_);
+  Snapshot* snapshot = new Snapshot(this);
+  snapshots_.push_back(snapshot);
+  return std::shared_ptr<const Snapshot>(snapshot);
+}
+
+void BPlusTree::Preserve(off_t offset, const void* block, size_t size) {
+  // Writers hold checkpoint_mutex_ shared, and snapshots are only taken and
+  // dropped under it exclusively, so snapshots_ does not change meanwhile.
+  std::shared_ptr<char[]> copy;
+  for (Snapshot* snapshot : snapshots_) {
+    if (offset >= snapshot->end_ || snapshot->Find(offset) != nullptr) {
+      continue;
+    }
+    if (copy == nullptr) {
+      copy.reset(new char[size]);
+      std::memcpy(copy.get(), block, size);
+    }
+    snapshot->Add(offset, copy);
+  }
+}
+
+std::vector<std::pair<std::string, std::string>> BPlusTree::GetRange(
+    const std::string& left_key, const std::string& right_key,
+    const std::shared_ptr<const Snapshot>& snapshot) const {
+  std::vector<std::pair<std::string, std::string>> res;
+  Cursor cursor(*this, snapshot);
+  for (cursor.Seek(left_key); cursor.Valid() && cursor.Key() <= right_key;
+       cursor.Next()) {
+    res.emplace_back(cursor.Key(), cursor.Value());
+  }
   return res;
 }
 
+BPlusTree::Cursor::Cursor(const BPlusTree& tree,
+                          std::shared_ptr<const Snapshot> snapshot)
+    : tree_(&tree), snapshot_(std::move(snapshot)), valid_(false),
+      leaf_(nullptr), version_(0), copy_(new LeafNode()), index_(0) {}
+
+BPlusTree::Cursor::~Cursor() { Release(); }
+
+void BPlusTree::Cursor::Seek(std::string_view key) {
+  bound_.assign(key);
+  SeekAfter();
+}
+
+void BPlusTree::Cursor::SeekToFirst() { Seek({}); }
+
+void BPlusTree::Cursor::SeekToLast() {
+  // Greater than every key.
+  bound_.assign(kMaxKeySize + 1, '\xff');
+  SeekBefore();
+}
+
+void BPlusTree::Cursor::Next() {
+  assert(Valid());
+  ++index_;
+  if (!StepRight()) SeekAfter();
+}
+
+void BPlusTree::Cursor::Prev() {
+  assert(Valid());
+  --index_;
+  if (!StepLeft()) SeekBefore();
+}
+
+std::string_view BPlusTree::Cursor::Key() const {
+  assert(Valid());
+  return copy_->Key(index_);
+}
+
+std::string_view BPlusTree::Cursor::Value() const {
+  assert(Valid());
+  return copy_->Value(index_);
+}
+
+// Copy leaf_node and keep it mapped if it did not change since version, or
+// unmap it.
+bool BPlusTree::Cursor::Load(const LeafNode* leaf_node, uint64_t version) {
+  std::memcpy(static_cast<void*>(copy_.get()), leaf_node, sizeof(LeafNode));
+  if (!leaf_node->Validate(version)) {
+    tree_->UnMap(leaf_node);
+    return false;
+  }
+  Release();
+  leaf_ = leaf_node;
+  version_ = version;
+  valid_ = true;
+  return true;
+}
+
+void BPlusTree::Cursor::Release() {
+  valid_ = false;
+  if (leaf_ == nullptr) return;
+  tree_->UnMap(leaf_);
+  leaf_ = nullptr;
+}
+
+// Move to the first record >= bound_.
+void BPlusTree::Cursor::SeekAfter() {
+  if (snapshot_ != nullptr) {
+    snapshot_->FindLeaf(bound_, copy_.get());
+    valid_ = true;
+    index_ = tree_->LowerBound(copy_.get(), bound_);
+    StepRight();
+    return;
+  }
+  for (;;) {
+    uint64_t version;
+    const LeafNode* leaf_node = tree_->FindLeaf(bound_, false, &version);
+    if (leaf_node == nullptr || !Load(leaf_node, version)) continue;
+    index_ = tree_->LowerBound(copy_.get(), bound_);
+    if (StepRight()) return;
+  }
+}
+
+// Move to the last record < bound_.
+void BPlusTree::Cursor::SeekBefore() {
+  if (snapshot_ != nullptr) {
+    snapshot_->FindLeaf(bound_, copy_.get());
+    valid_ = true;
+    index_ = tree_->LowerBound(copy_.get(), bound_) - 1;
+    StepLeft();
+    return;
+  }
+  for (;;) {
+    uint64_t version;
+    const LeafNode* leaf_node = tree_->FindLeaf(bound_, false, &version);
+    if (leaf_node == nullptr || !Load(leaf_node, version)) continue;
+    index_ = tree_->LowerBound(copy_.get(), bound_) - 1;
+    if (StepLeft()) return;
+  }
+}
+
+// If index_ is past the copied leaf, move to the first record of the leaves
+// right to it, or release the leaf at the end. Return false if a writer got
+// in the way.
+bool BPlusTree::Cursor::StepRight() {
+  while (index_ >= copy_->Count()) {
+    if (copy_->Count() > 0) {
+      bound_.assign(copy_->Key(copy_->Count() - 1));
+      bound_.push_back('\0');
+    }
+    // The right link of the copy is only good if leaf_ did not change, and
+    // the version of the right leaf only if leaf_ still points to it.
+    off_t of_right = copy_->right;
+    if (snapshot_ == nullptr && !leaf_->Validate(version_)) return false;
+    if (of_right == 0) {
+      Release();
+      return true;
+    }
+    if (snapshot_ != nullptr) {
+      // Leaves read through a snapshot never change.
+      snapshot_->Read(of_right, copy_.get());
+      index_ = 0;
+      continue;
+    }
+    const LeafNode* right_node = tree_->Map<LeafNode>(of_right);
+    uint64_t version;
+    if (!right_node->ReadLock(&version) || !leaf_->Validate(version_)) {
+      tree_->UnMap(right_node);
+      return false;
+    }
+    if (!Load(right_node, version)) return false;
+    index_ = 0;
+  }
+  return true;
+}
+
+// Same as StepRight(), to the left when index_ is before the copied leaf.
+bool BPlusTree::Cursor::StepLeft() {
+  while (index_ < 0) {
+    if (copy_->Count() > 0) bound_.assign(copy_->Key(0));
+    off_t of_left = copy_->left;
+    if (snapshot_ == nullptr && !leaf_->Validate(version_)) return false;
+    if (of_left == 0) {
+      Release();
+      return true;
+    }
+    if (snapshot_ != nullptr) {
+      snapshot_->Read(of_left, copy_.get());
+      index_ = copy_->Count() - 1;
+      continue;
+    }
+    const LeafNode* left_node = tree_->Map<LeafNode>(of_left);
+    uint64_t version;
+    if (!left_node->ReadLock(&version) || !leaf_->Validate(version_)) {
+      tree_->UnMap(left_node);
+      return false;
+    }
+    if (!Load(left_node, version)) return false;
+    index_ = copy_->Count() - 1;
+  }
+  return true;
+}
+
 bool BPlusTree::Empty() const { return meta_->size == 0; }
 
 size_t BPlusTree::Size() const { return meta_->size; }
 
+BPlusTree::Statistics BPlusTree::Stats() const {
+  Statistics stats;
+  block_cache_->AddStats(&stats);
+  {
+    std::lock_guard<std::mutex> lock(smo_mutex_);
+    stats.splits = splits_;
+    stats.merges = merges_;
+    stats.borrows = borrows_;
+    stats.free_leaf_blocks = free_blocks_[LeafNode::kSizeClass].size();
+    stats.free_index_blocks = free_blocks_[IndexNode::kSizeClass].size();
+    stats.leaf_blocks =
+        meta_->blocks[LeafNode::kSizeClass] - stats.free_leaf_blocks;
+    stats.index_blocks =
+        meta_->blocks[IndexNode::kSizeClass] - stats.free_index_blocks;
+    stats.file_bytes = meta_->block;
+  }
+  stats.height = meta_->height;
+  stats.size = meta_->size;
+  if (stats.leaf_blocks > 0) {
+    stats.leaf_fill = static_cast<double>(meta_->record_bytes) /
+                      (stats.leaf_blocks * LeafNode::kDataSize);
+  }
+  return stats;
+}
+
+uint64_t BPlusTree::Histogram::Percentile(double p) const {
+  uint64_t rank = std::ceil(p * count), seen = 0;
+  for (const auto& [highest, n] : buckets) {
+    seen += n;
+    if (seen >= rank) return std::min(highest, max);
+  }
+  return max;
+}
+
+BPlusTree::Histogram BPlusTree::Latency(Phase phase) const {
+  return tracer_ != nullptr ? tracer_->Latency(phase) : Histogram();
+}
+
+std::vector<BPlusTree::TraceEvent> BPlusTree::TraceEvents() const {
+  return tracer_ != nullptr ? tracer_->Events() : std::vector<TraceEvent>();
+}
+
 // Try Borrow key from left sibling.
 bool BPlusTree::BorrowFromLeftLeafSibling(LeafNode* leaf_node) {
-  if (leaf_node->left == 0) return false;
-  LeafNode* sibling = Map<LeafNode>(leaf_node->left);
-  if (sibling->parent != leaf_node->parent || sibling->count <= GetMinKeys()) {
-    if (sibling->parent == leaf_node->parent) {
-      assert(sibling->count == GetMinKeys());
-    }
+  IndexNode* parent_node = Map<IndexNode>(Parent(leaf_node));
+  int index = GetIndexFromIndexNode(parent_node, leaf_node->offset);
+  if (index == 0) {
+    UnMap(parent_node);
+    return false;
+  }
+  LeafNode* sibling = Map<LeafNode>(parent_node->Child(index - 1));
+  assert(sibling->offset == leaf_node->left);
+  int last = sibling->count - 1;
+  if (sibling->count <= 1 ||
+      sibling->UsedSize() - sibling->RecordSize(last) <
+          LeafNode::kMinUsedSize ||
+      !leaf_node->CanInsert(sibling->Key(last), sibling->Value(last)) ||
+      !parent_node->CanUpdateKey(
+          index - 1, Separator(sibling->Key(last - 1), sibling->Key(last)))) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
+  std::string separator(
+      Separator(sibling->Key(last - 1), sibling->Key(last)));
+
   // 1. Borrow last key from left sibling.
-  leaf_node->InsertKVAtIndex(0, sibling->LastKey(), sibling->LastValue());
-  --sibling->count;
+  leaf_node->InsertKVAtIndex(0, sibling->Key(last), sibling->Value(last));
+  sibling->DeleteKVAtIndex(last);
 
   // 2. Update parent's key.
-  IndexNode* parent_node = Map<IndexNode>(leaf_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  parent_node->UpdateKey(index, leaf_node->FirstKey());
-  UnMap<IndexNode>(parent_node);
-  UnMap<LeafNode>(sibling);
+  parent_node->UpdateKey(index - 1, separator);
+  UnMap(parent_node);
+  UnMap(sibling);
   return true;
 }
 
 // Try Borrow key from right sibling.
 bool BPlusTree::BorrowFromRightLeafSibling(LeafNode* leaf_node) {
-  if (leaf_node->right == 0) return false;
-  LeafNode* sibling = Map<LeafNode>(leaf_node->right);
-
-  if (sibling->parent != leaf_node->parent || sibling->count <= GetMinKeys()) {
-    if (sibling->parent == leaf_node->parent) {
-      assert(sibling->count == GetMinKeys());
-    }
+  IndexNode* parent_node = Map<IndexNode>(Parent(leaf_node));
+  int index = GetIndexFromIndexNode(parent_node, leaf_node->offset);
+  if (index == static_cast<int>(parent_node->count)) {
+    UnMap(parent_node);
+    return false;
+  }
+  LeafNode* sibling = Map<LeafNode>(parent_node->Child(index + 1));
+  assert(sibling->offset == leaf_node->right);
+  if (sibling->count <= 1 ||
+      sibling->UsedSize() - sibling->RecordSize(0) < LeafNode::kMinUsedSize ||
+      !leaf_node->CanInsert(sibling->Key(0), sibling->Value(0)) ||
+      !parent_node->CanUpdateKey(
+          index, Separator(sibling->Key(0), sibling->Key(1)))) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
+  std::string separator(Separator(sibling->Key(0), sibling->Key(1)));
 
   // 1. Borrow frist key from right sibling.
-  leaf_node->UpdateKV(leaf_node->count++, sibling->FirstKey(),
-                      sibling->FirstValue());
+  leaf_node->InsertKVAtIndex(leaf_node->count, sibling->FirstKey(),
+                             sibling->Value(0));
   sibling->DeleteKVAtIndex(0);
 
   // 2. Update parent's key.
-  IndexNode* parent_node = Map<IndexNode>(leaf_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  parent_node->UpdateKey(index - 1, sibling->FirstKey());
+  parent_node->UpdateKey(index, separator);
 
-  UnMap<IndexNode>(parent_node);
-  UnMap<LeafNode>(sibling);
+  UnMap(parent_node);
+  UnMap(sibling);
   return true;
 }
 
 inline bool BPlusTree::BorrowFromLeafSibling(LeafNode* leaf_node) {
-  assert(leaf_node->count == GetMinKeys() - 1);
-  assert(leaf_node->parent != 0);
-  return BorrowFromLeftLeafSibling(leaf_node) ||
-         BorrowFromRightLeafSibling(leaf_node);
+  assert(leaf_node->Underfull());
+  assert(Parent(leaf_node) != 0);
+  if (!BorrowFromLeftLeafSibling(leaf_node) &&
+      !BorrowFromRightLeafSibling(leaf_node)) {
+    return false;
+  }
+  CountAtLevel(&borrows_, 0);
+  TRACE_EVENT(tracer_, kBorrow, 0, leaf_node->offset);
+  return true;
 }
 
 // Try merge left leaf node.
 bool BPlusTree::MergeLeftLeaf(LeafNode* leaf_node) {
-  if (leaf_node->left == 0) return false;
-  LeafNode* sibling = Map<LeafNode>(leaf_node->left);
-  if (sibling->parent != leaf_node->parent) {
+  IndexNode* parent_node = Map<IndexNode>(Parent(leaf_node));
+  int index = GetIndexFromIndexNode(parent_node, leaf_node->offset);
+  if (index == 0) {
+    UnMap(parent_node);
+    return false;
+  }
+  LeafNode* sibling = Map<LeafNode>(parent_node->Child(index - 1));
+  if (leaf_node->UsedSize() + sibling->UsedSize() > LeafNode::kDataSize) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  assert(sibling->count == GetMinKeys());
-  // 1. Delete key from parent.
-  IndexNode* parent_node = Map<IndexNode>(leaf_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  parent_node->DeleteKeyAtIndex(index);
+  // 1. Delete key and sibling from parent.
+  parent_node->DeleteKeyAtIndex(index - 1);
 
   // 2. Merge left sibling.
   leaf_node->MergeLeftSibling(sibling);
@@ -834,18 +4418,21 @@ bool BPlusTree::MergeLeftLeaf(LeafNode* leaf_node) {
 
 // Try Merge right node.
 bool BPlusTree::MergeRightLeaf(LeafNode* leaf_node) {
-  if (leaf_node->right == 0) return false;
-  LeafNode* sibling = Map<LeafNode>(leaf_node->right);
-  if (sibling->parent != leaf_node->parent) {
+  IndexNode* parent_node = Map<IndexNode>(Parent(leaf_node));
+  int index = GetIndexFromIndexNode(parent_node, leaf_node->offset);
+  if (index == static_cast<int>(parent_node->count)) {
+    UnMap(parent_node);
+    return false;
+  }
+  LeafNode* sibling = Map<LeafNode>(parent_node->Child(index + 1));
+  if (leaf_node->UsedSize() + sibling->UsedSize() > LeafNode::kDataSize) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  // 1. Delete key from parent.
-  IndexNode* parent_node = Map<IndexNode>(leaf_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  parent_node->UpdateKey(index - 1, parent_node->Key(index));
+  // 1. Delete key and sibling from parent.
+  parent_node->UpdateOffset(index + 1, leaf_node->offset);
   parent_node->DeleteKeyAtIndex(index);
   UnMap(parent_node);
 
@@ -864,108 +4451,119 @@ bool BPlusTree::MergeRightLeaf(LeafNode* leaf_node) {
   return true;
 }
 
-inline BPlusTree::LeafNode* BPlusTree::MergeLeaf(LeafNode* leaf_node) {
+inline bool BPlusTree::MergeLeaf(LeafNode* leaf_node) {
   // Merge left node to leaf_node or right node to leaf_node.
-  assert(leaf_node->count == GetMinKeys() - 1);
-  assert(leaf_node->parent != 0);
+  assert(leaf_node->Underfull());
+  assert(Parent(leaf_node) != 0);
   assert(meta_->root != leaf_node->offset);
-  assert(MergeLeftLeaf(leaf_node) || MergeRightLeaf(leaf_node));
-  return leaf_node;
+  if (!MergeLeftLeaf(leaf_node) && !MergeRightLeaf(leaf_node)) return false;
+  CountAtLevel(&merges_, 0);
+  TRACE_EVENT(tracer_, kMerge, 0, leaf_node->offset);
+  return true;
 }
 
 // Try Swap key between index_node's left sibling and index_node's parent.
 bool BPlusTree::BorrowFromLeftIndexSibling(IndexNode* index_node) {
-  if (index_node->left == 0) return false;
-  IndexNode* sibling = Map<IndexNode>(index_node->left);
-  if (sibling->parent != index_node->parent || sibling->count <= GetMinKeys()) {
-    if (sibling->parent == index_node->parent) {
-      assert(sibling->count == GetMinKeys());
-    }
+  IndexNode* parent_node = Map<IndexNode>(Parent(index_node));
+  int index = GetIndexFromIndexNode(parent_node, index_node->offset);
+  if (index == 0) {
+    UnMap(parent_node);
+    return false;
+  }
+  IndexNode* sibling = Map<IndexNode>(parent_node->Child(index - 1));
+  if (sibling->count <= 1 ||
+      sibling->UsedSize() - sibling->EntrySize(sibling->count - 1) <
+          IndexNode::kMinUsedSize ||
+      !index_node->CanInsert(parent_node->Key(index - 1)) ||
+      !parent_node->CanUpdateKey(index - 1, sibling->LastKey())) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  // 1.Insert parent'key to the first of index_node's keys.
-  IndexNode* parent_node = Map<IndexNode>(index_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  index_node->InsertKeyAtIndex(0, parent_node->Key(index));
+  // 1. Insert parent's key and sibling's last child to the first of
+  // index_node.
+  off_t of_child = sibling->Child(sibling->count);
+  index_node->InsertIndexAtIndex(0, parent_node->Key(index - 1), of_child);
 
-  // 2. Change parent's key.
-  parent_node->UpdateKey(index, sibling->LastKey());
+  // 2. Change parent's key to sibling's last key.
+  parent_node->UpdateKey(index - 1, sibling->LastKey());
 
-  // 3. Link sibling's last child to index_node,
-  // and delete sibling's last child.
-  Node* last_sibling_child =
-      Map<Node>(sibling->indexes[sibling->count--].offset);
-  index_node->indexes[0].offset = last_sibling_child->offset;
-  last_sibling_child->parent = index_node->offset;
+  // 3. Delete sibling's last key and last child.
+  sibling->DeleteLastKey();
 
-  UnMap(last_sibling_child);
   UnMap(parent_node);
   UnMap(sibling);
   return true;
 }
 
 bool BPlusTree::BorrowFromRightIndexSibling(IndexNode* index_node) {
-  if (index_node->right == 0) return false;
-  IndexNode* sibling = Map<IndexNode>(index_node->right);
-  if (sibling->parent != index_node->parent || sibling->count <= GetMinKeys()) {
-    if (sibling->parent == index_node->parent) {
-      assert(sibling->count == GetMinKeys());
-    }
+  IndexNode* parent_node = Map<IndexNode>(Parent(index_node));
+  int index = GetIndexFromIndexNode(parent_node, index_node->offset);
+  if (index == static_cast<int>(parent_node->count)) {
+    UnMap(parent_node);
+    return false;
+  }
+  IndexNode* sibling = Map<IndexNode>(parent_node->Child(index + 1));
+  if (sibling->count <= 1 ||
+      sibling->UsedSize() - sibling->EntrySize(0) < IndexNode::kMinUsedSize ||
+      !index_node->CanInsert(parent_node->Key(index)) ||
+      !parent_node->CanUpdateKey(index, sibling->FirstKey())) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  // 1.Insert parent‘key to the last of index_node's keys.
-  IndexNode* parent = Map<IndexNode>(index_node->parent);
-  int index = UpperBound(parent->indexes, parent->count, sibling->LastKey());
-  index_node->UpdateKey(index_node->count++, parent->Key(index - 1));
+  // 1. Insert parent's key to the last of index_node's keys, and link
+  // sibling's first child to index_node.
+  off_t of_child = sibling->Child(0);
+  int last = index_node->count;
+  index_node->InsertIndexAtIndex(last, parent_node->Key(index),
+                                 index_node->Child(last));
+  index_node->UpdateOffset(last + 1, of_child);
 
-  // 2. Change parent's key.
-  parent->UpdateKey(index - 1, sibling->FirstKey());
+  // 2. Change parent's key to sibling's first key.
+  parent_node->UpdateKey(index, sibling->FirstKey());
 
-  // 3. Link index_node's last child to sibling's first child,
-  // and delete sibling's first child.
-  Node* first_sibling_child = Map<Node>(sibling->indexes[0].offset);
-  index_node->indexes[index_node->count].offset = first_sibling_child->offset;
-  first_sibling_child->parent = index_node->offset;
+  // 3. Delete sibling's first key and first child.
   sibling->DeleteKeyAtIndex(0);
 
-  UnMap(first_sibling_child);
-  UnMap(parent);
+  UnMap(parent_node);
   UnMap(sibling);
   return true;
 }
 
 inline bool BPlusTree::BorrowFromIndexSibling(IndexNode* index_node) {
-  assert(index_node->count == GetMinKeys() - 1);
-  return BorrowFromLeftIndexSibling(index_node) ||
-         BorrowFromRightIndexSibling(index_node);
+  assert(index_node->Underfull());
+  if (!BorrowFromLeftIndexSibling(index_node) &&
+      !BorrowFromRightIndexSibling(index_node)) {
+    return false;
+  }
+  CountAtLevel(&borrows_, index_node->level);
+  TRACE_EVENT(tracer_, kBorrow, index_node->level, index_node->offset);
+  return true;
 }
 
 // Try merge left index node.
 bool BPlusTree::MergeLeftIndex(IndexNode* index_node) {
-  if (index_node->left == 0) return false;
-  IndexNode* sibling = Map<IndexNode>(index_node->left);
-  if (sibling->parent != index_node->parent) {
+  IndexNode* parent_node = Map<IndexNode>(Parent(index_node));
+  int index = GetIndexFromIndexNode(parent_node, index_node->offset);
+  if (index == 0) {
+    UnMap(parent_node);
+    return false;
+  }
+  IndexNode* sibling = Map<IndexNode>(parent_node->Child(index - 1));
+  if (sibling->MergedSize(index_node, parent_node->Key(index - 1)) >
+      IndexNode::kDataSize) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  assert(sibling->count == GetMinKeys());
-  // 1. Merge left sibling to index_node.
-  index_node->MergeLeftSibling(sibling);
+  // 1. Merge left sibling and parent's key between them to index_node.
+  index_node->MergeLeftSibling(sibling, parent_node->Key(index - 1));
 
-  // 2. Link sibling's childs to index_node.
-  for (size_t i = 0; i < sibling->count + 1; ++i) {
-    Node* child_node = Map<Node>(sibling->indexes[i].offset);
-    child_node->parent = index_node->offset;
-    UnMap(child_node);
-  }
-
-  // 3. Link new sibling.
+  // 2. Link new sibling.
   index_node->left = sibling->left;
   if (sibling->left != 0) {
     IndexNode* new_sibling = Map<IndexNode>(sibling->left);
@@ -973,45 +4571,34 @@ bool BPlusTree::MergeLeftIndex(IndexNode* index_node) {
     UnMap(new_sibling);
   }
 
-  // 4. Update index_node's mid key.
-  IndexNode* parent_node = Map<IndexNode>(index_node->parent);
-  int index =
-      UpperBound(parent_node->indexes, parent_node->count, sibling->LastKey());
-  index_node->UpdateKey(sibling->count, parent_node->Key(index));
-
-  // 5. Delete parent's key.
-  parent_node->DeleteKeyAtIndex(index);
+  // 3. Delete parent's key and sibling.
+  parent_node->DeleteKeyAtIndex(index - 1);
 
+  UnMap(parent_node);
   Dealloc(sibling);
   return true;
 }
 
 // Try merge right index node.
 bool BPlusTree::MergeRightIndex(IndexNode* index_node) {
-  if (index_node->right == 0) return false;
-  IndexNode* sibling = Map<IndexNode>(index_node->right);
-  if (sibling->parent != index_node->parent) {
+  IndexNode* parent_node = Map<IndexNode>(Parent(index_node));
+  int index = GetIndexFromIndexNode(parent_node, index_node->offset);
+  if (index == static_cast<int>(parent_node->count)) {
+    UnMap(parent_node);
+    return false;
+  }
+  IndexNode* sibling = Map<IndexNode>(parent_node->Child(index + 1));
+  if (index_node->MergedSize(sibling, parent_node->Key(index)) >
+      IndexNode::kDataSize) {
     UnMap(sibling);
+    UnMap(parent_node);
     return false;
   }
 
-  assert(sibling->count == GetMinKeys());
-  // 1. Update index_node's last key.
-  IndexNode* parent = Map<IndexNode>(index_node->parent);
-  int index = UpperBound(parent->indexes, parent->count, sibling->LastKey());
-  index_node->UpdateKey(index_node->count++, parent->Key(index - 1));
+  // 1. Merge parent's key between them and right sibling to index_node.
+  index_node->MergeRightSibling(sibling, parent_node->Key(index));
 
-  // 2. Merge right sibling to index_node.
-  index_node->MergeRightSibling(sibling);
-
-  // 3. Link sibling's childs to index_node.
-  for (size_t i = 0; i < sibling->count + 1; ++i) {
-    Node* child_node = Map<Node>(sibling->indexes[i].offset);
-    child_node->parent = index_node->offset;
-    UnMap(child_node);
-  }
-
-  // 4. Link new sibling.
+  // 2. Link new sibling.
   index_node->right = sibling->right;
   if (sibling->right != 0) {
     IndexNode* new_sibling = Map<IndexNode>(sibling->right);
@@ -1019,60 +4606,65 @@ bool BPlusTree::MergeRightIndex(IndexNode* index_node) {
     UnMap(new_sibling);
   }
 
-  // 5. Delete parent's key.
-  parent->UpdateKey(index - 1, parent->Key(index));
-  parent->DeleteKeyAtIndex(index);
+  // 3. Delete parent's key and sibling.
+  parent_node->UpdateOffset(index + 1, index_node->offset);
+  parent_node->DeleteKeyAtIndex(index);
 
+  UnMap(parent_node);
   Dealloc(sibling);
   return true;
 }
 
-inline BPlusTree::IndexNode* BPlusTree::MergeIndex(IndexNode* index_node) {
-  assert(index_node->count == GetMinKeys() - 1);
-  assert(index_node->parent != 0);
+inline bool BPlusTree::MergeIndex(IndexNode* index_node) {
+  assert(index_node->Underfull());
+  assert(Parent(index_node) != 0);
   assert(meta_->root != index_node->offset);
-  assert(MergeLeftIndex(index_node) || MergeRightIndex(index_node));
-  return index_node;
+  if (!MergeLeftIndex(index_node) && !MergeRightIndex(index_node)) {
+    return false;
+  }
+  CountAtLevel(&merges_, index_node->level);
+  TRACE_EVENT(tracer_, kMerge, index_node->level, index_node->offset);
+  return true;
 }
 
 #ifdef DEBUG
 #include <queue>
-void BPlusTree::Dump() {
+void BPlusTree::Dump() const {
   std::vector<std::vector<std::vector<std::string>>> res(
-      5, std::vector<std::vector<std::string>>());
-  std::queue<std::pair<off_t, int>> q;
-  q.emplace(meta_->root, 1);
+      meta_->height + 1, std::vector<std::vector<std::string>>());
+  std::queue<std::pair<off_t, size_t>> q;
+  q.emplace(meta_->root.load(), 1);
   while (!q.empty()) {
     auto cur = q.front();
     q.pop();
     if (cur.second < meta_->height) {
-      IndexNode* index_node = Map<IndexNode>(cur.first);
+      const IndexNode* index_node = Map<IndexNode>(cur.first);
       std::vector<std::string> v;
-      for (int i = 0; i < index_node->count + 1; ++i) {
+      for (size_t i = 0; i < index_node->count + 1; ++i) {
         if (i == index_node->count) {
           v.push_back("");
         } else {
-          v.push_back(index_node->indexes[i].key);
+          v.emplace_back(index_node->Key(i));
         }
-        if (index_node->indexes[i].offset != 0) {
-          q.emplace(index_node->indexes[i].offset, cur.second + 1);
+        if (index_node->Child(i) != 0) {
+          q.emplace(index_node->Child(i), cur.second + 1);
         }
       }
       res[cur.second].push_back(v);
       UnMap(index_node);
     } else {
-      LeafNode* leaf_node = Map<LeafNode>(cur.first);
+      const LeafNode* leaf_node = Map<LeafNode>(cur.first);
       std::vector<std::string> v;
-      for (int i = 0; i < leaf_node->count; ++i) {
-        v.push_back(leaf_node->records[i].key);
+      for (size_t i = 0; i < leaf_node->count; ++i) {
+        v.emplace_back(leaf_node->Key(i));
       }
       res[cur.second].push_back(v);
       UnMap(leaf_node);
     }
   }
 
-  for (int i = 1; i <= meta_->height; ++i) {
-    for (int j = 0; j < meta_->height - i; ++j) {
+  for (size_t i = 1; i <= meta_->height; ++i) {
+    for (size_t j = 0; j < meta_->height - i; ++j) {
       LOG2("%s", "\t");
     }
     for (auto& v : res[i]) {
@@ -1084,4 +4676,4 @@ void BPlusTree::Dump() {
     LOG2("%s", "\n");
   }
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,8 +1,20 @@
 #ifndef BPLUS_TREE_H
 #define BPLUS_TREE_H
 
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
 #define DEBUG
@@ -21,55 +33,367 @@
 
 class BPlusTree {
   struct Meta;
-  struct Index;
-  struct Record;
   struct Node;
   struct IndexNode;
   struct LeafNode;
+  struct FreeListBlock;
   class BlockCache;
+  class Wal;
+  class Tracer;
 
  public:
-  BPlusTree(const char* path);
+  enum class StorageMode {
+    kBlockMap,  // mmap() every block on cache miss, munmap() on eviction.
+    kArena,     // Map the whole file as one growable arena.
+    kBuffered,  // pread() every block into a buffer on cache miss, pwrite() it
+                // back on eviction if it changed.
+  };
+
+  // How the block cache picks blocks to evict.
+  enum class CachePolicy {
+    kLru,  // Least recently used.
+    k2Q,   // Blocks seen once queue apart and can not flush blocks used again
+           // or index nodes, so a large scan does not wipe hot blocks.
+  };
+
+  // When write-ahead log records reach the disk.
+  enum class SyncPolicy {
+    kNone,      // Buffer and leave it to the OS, a crash may lose writes.
+    kEveryOp,   // fdatasync() before Put or Delete returns.
+    kInterval,  // fdatasync() every sync_interval_ms in the background.
+  };
+
+  struct Options {
+    Options()
+        : storage_mode(StorageMode::kBlockMap),
+          cache_policy(CachePolicy::k2Q),
+          cache_size(5 * 1024 * 1024),
+          use_wal(false),
+          sync_policy(SyncPolicy::kEveryOp),
+          sync_interval_ms(10),
+          checkpoint_size(64 * 1024 * 1024),
+          sparse_leaves(false),
+          compress_leaves(false),
+          use_io_uring(false) {}
+
+    StorageMode storage_mode;
+    CachePolicy cache_policy;
+    // Bytes of unreferenced blocks the cache keeps mapped.
+    size_t cache_size;
+    // Log writes to <path>.wal.<n> and only change the db file at
+    // checkpoints, so that a crash never leaves a torn tree behind.
+    bool use_wal;
+    SyncPolicy sync_policy;
+    int sync_interval_ms;
+    // Checkpoint when the log or the dirty blocks grow beyond this many bytes.
+    size_t checkpoint_size;
+    // Punch the pages of a changed leaf that hold neither slots nor records
+    // out of the db file when the leaf leaves the cache, so that underfull
+    // leaves take fewer disk blocks and no page cache for their free space.
+    bool sparse_leaves;
+    // With kBuffered, store leaves encoded in the db file: keys as the rest
+    // after the prefix they share with the key before, values compressed
+    // with LZ77. A leaf is decoded into its cache buffer on a miss and
+    // encoded again when it is written back, it keeps its offset and the
+    // pages it no longer fills are punched out, so both disk and page cache
+    // only hold the encoded pages. Only leaves that span several pages
+    // shrink. A db file that has encoded leaves has to be opened with it.
+    bool compress_leaves;
+    // With kBuffered, write back the blocks evicted together in one io_uring
+    // submission, merging blocks next to each other in the file into one
+    // write. Falls back to pwrite() if the kernel has no io_uring.
+    bool use_io_uring;
+  };
+
+  // Put rejects longer keys.
+  static constexpr size_t kMaxKeySize = 256;
+
+  BPlusTree(const char* path, const Options& options = Options());
   ~BPlusTree();
 
-  void Put(const std::string& key, const std::string& value);
-  bool Delete(const std::string& key);
-  bool Get(const std::string& key, std::string& value) const;
+  // Return false if key or record is too large to be stored.
+  bool Put(std::string_view key, std::string_view value);
+  bool Delete(std::string_view key);
+
+  // Puts and deletes to apply together, see Apply().
+  class WriteBatch {
+   public:
+    void Put(std::string_view key, std::string_view value) {
+      ops_.push_back(Op{true, std::string(key), std::string(value)});
+    }
+    void Delete(std::string_view key) {
+      ops_.push_back(Op{false, std::string(key), std::string()});
+    }
+    void Clear() { ops_.clear(); }
+    size_t Count() const { return ops_.size(); }
+
+   private:
+    friend class BPlusTree;
+    struct Op {
+      bool put;
+      std::string key;
+      std::string value;
+    };
+    std::vector<Op> ops_;
+  };
+  // Apply the operations of batch, a later one on a key wins over an earlier
+  // one. They are sorted by key and applied leaf by leaf, one descent per
+  // leaf, and a leaf that overflows is split at once into as many leaves as
+  // its records need. Every node the batch changes stays locked until it is
+  // done, so a snapshot sees all of it or none and readers never see a leaf
+  // half way. Returns false without applying anything if a key or record is
+  // too large.
+  bool Apply(const WriteBatch& batch);
+  // Load records sorted by key into an empty tree. Leaves are packed up to
+  // fill_factor of their size one after another at the end of the file, then
+  // index nodes are built bottom-up. Returns false if the tree is not empty,
+  // or at the first record that is too large or whose key is not greater than
+  // the one before, the records before it are loaded. Other writers must not
+  // run meanwhile.
+  template <typename Iterator>
+  bool BulkLoad(Iterator begin, Iterator end, double fill_factor = 0.9) {
+    return BulkLoad(
+        [&](std::string* key, std::string* value) {
+          if (begin == end) return false;
+          *key = begin->first;
+          *value = begin->second;
+          ++begin;
+          return true;
+        },
+        fill_factor);
+  }
+  // Same, records are read from next() until it returns false.
+  bool BulkLoad(const std::function<bool(std::string* key, std::string* value)>&
+                    next,
+                double fill_factor = 0.9);
+  bool Get(std::string_view key, std::string& value) const;
+  // Copy a value of exactly size bytes to value. Returns false if key is not
+  // found or its value has another size, value may be overwritten then.
+  bool Get(std::string_view key, void* value, size_t size) const;
+  // Values of keys in the same order, for batches of lookups. The keys
+  // descend together in key order, level by level: a node is searched once
+  // for all keys that route through it, and the nodes of the next level are
+  // all mapped and prefetched before any is searched, so that their misses
+  // overlap. With io_uring, missing buffered blocks of a level are read in
+  // one submission.
+  std::vector<std::optional<std::string>> MultiGet(
+      std::span<const std::string_view> keys) const;
+  // A consistent view of the tree as of GetSnapshot(), for long scans that
+  // run alongside writers. Nodes still change in place: the first time a
+  // block changes after a snapshot was taken, the writer copies its old
+  // contents aside, and readers of the snapshot take that copy over the block.
+  // Readers find copies without locking. Copies are freed with the last
+  // snapshot that needs them, so a snapshot held through a long scan while
+  // writers keep going grows by one copy of every block changed meanwhile,
+  // up to the size of the tree. Dropping a snapshot waits for the writers
+  // in flight. A snapshot must not outlive the tree.
+  class Snapshot;
+  std::shared_ptr<const Snapshot> GetSnapshot();
+
+  // Records with left_key <= key <= right_key, as of snapshot if given.
   std::vector<std::pair<std::string, std::string>> GetRange(
-      const std::string& left_key, const std::string& right_key) const;
+      const std::string& left_key, const std::string& right_key,
+      const std::shared_ptr<const Snapshot>& snapshot = nullptr) const;
   bool Empty() const;
   size_t Size() const;
 
+  // Counters since the tree was opened, and the shape of the tree now.
+  struct Statistics {
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t evictions = 0;
+    uint64_t mmaps = 0;
+    uint64_t munmaps = 0;
+    uint64_t ftruncates = 0;
+    uint64_t hole_punches = 0;  // see sparse_leaves and compress_leaves
+    uint64_t reads = 0;         // of blocks with kBuffered
+    uint64_t writes = 0;
+    size_t cached_bytes = 0;    // of the blocks in the cache
+    size_t mapped_bytes = 0;    // of the db file mapped into memory
+    // Structure changes by level of the node that changed, 0 for leaves.
+    std::vector<uint64_t> splits;
+    std::vector<uint64_t> merges;
+    std::vector<uint64_t> borrows;
+    size_t height = 0;
+    size_t size = 0;
+    size_t leaf_blocks = 0;
+    size_t index_blocks = 0;
+    size_t free_leaf_blocks = 0;
+    size_t free_index_blocks = 0;
+    size_t file_bytes = 0;   // up to the end of the last block
+    double leaf_fill = 0;    // bytes of records and slots per byte of leaves
+  };
+  // Cheap enough to call every few seconds, the hot paths only bump counters
+  // under locks they take anyway.
+  Statistics Stats() const;
+
+  // Phases timed when built with -DBPLUS_TREE_TRACE(make TRACE=1), otherwise
+  // the timers compile to nothing and the histograms stay empty. A phase is
+  // also counted in the operation around it.
+  enum class Phase {
+    kGet,
+    kPut,
+    kDelete,
+    kDescend,          // root to leaf, a retry is another sample
+    kStructureChange,  // splits or merges, waiting for smo_mutex_ included
+    kSplit,            // one node
+    kLoad,             // mapping a block on a cache miss, faults come later
+    kEvict,            // one block
+    kCommit,           // waiting for the log to be synced
+    kCheckpoint,       // capturing dirty blocks, writers wait meanwhile
+    kPhaseCount
+  };
+  // Nanoseconds, bucketed to within 1/16 of the value.
+  struct Histogram {
+    uint64_t count = 0;
+    uint64_t max = 0;
+    // Highest value of each bucket that is not empty and its count.
+    std::vector<std::pair<uint64_t, uint64_t>> buckets;
+    uint64_t Percentile(double p) const;
+  };
+  Histogram Latency(Phase phase) const;
+
+  // Structure changes, the last 4096 are kept in a ring when built with
+  // -DBPLUS_TREE_TRACE.
+  struct TraceEvent {
+    enum Type : uint8_t { kSplit, kMerge, kBorrow, kRootChange, kRelocate };
+    uint64_t time_ns;  // steady clock
+    Type type;
+    uint32_t level;
+    off_t offset;  // of the node that changed, or of the new root
+  };
+  // Oldest first.
+  std::vector<TraceEvent> TraceEvents() const;
+
+  // Move up to max_nodes nodes into the lowest free block of their size if
+  // that is nearer to the start of the file, walking the tree level by level
+  // in key order from where the last call stopped. Returns true once the walk
+  // reached the root, after the free blocks at the end of the file were cut
+  // off, the next call starts over. Runs alongside readers and writers.
+  bool Compact(size_t max_nodes = 64);
+
+  // Iterates records in key order without copying them one by one. The
+  // cursor keeps the leaf it is on mapped and reads a consistent copy of it
+  // when it enters it, Key() and Value() point into that copy and stay valid
+  // until the cursor moves. Concurrent writers are seen leaf by leaf, unless
+  // the cursor reads a snapshot. The cursor must not outlive the tree.
+  class Cursor {
+   public:
+    explicit Cursor(const BPlusTree& tree,
+                    std::shared_ptr<const Snapshot> snapshot = nullptr);
+    ~Cursor();
+    Cursor(const Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+
+    // Move to the first record with key >= key.
+    void Seek(std::string_view key);
+    void SeekToFirst();
+    void SeekToLast();
+    bool Valid() const { return valid_; }
+    void Next();
+    void Prev();
+    std::string_view Key() const;
+    std::string_view Value() const;
+
+   private:
+    bool Load(const LeafNode* leaf_node, uint64_t version);
+    void Release();
+    void SeekAfter();
+    void SeekBefore();
+    bool StepRight();
+    bool StepLeft();
+
+    const BPlusTree* tree_;
+    // Leaves are copied from the snapshot if there is one, and never change.
+    std::shared_ptr<const Snapshot> snapshot_;
+    bool valid_;
+    const LeafNode* leaf_;  // mapped leaf the copy was taken from
+    uint64_t version_;      // version of leaf_ when it was copied
+    std::unique_ptr<LeafNode> copy_;
+    int index_;  // of the current record in copy_
+    // Where to seek again when a writer got in the way, records from bound_
+    // on are left to visit going forward and the ones before it going back.
+    std::string bound_;
+  };
+
 #ifdef DEBUG
-  void Dump();
+  void Dump() const;
 #endif
 
  private:
+  // Mapping a block from a non-const method marks it dirty.
+  template <typename T>
+  T* Map(off_t offset);
   template <typename T>
-  T* Map(off_t offset) const;
+  const T* Map(off_t offset) const;
   template <typename T>
-  void UnMap(T* map_obj) const;
+  void UnMap(const T* map_obj) const;
+  // Release the nodes write locked by Map() during a structure change.
+  void UnlockAll();
   template <typename T>
-  T* Alloc();
+  T* Alloc(off_t hint);
   template <typename T>
   void Dealloc(T* node);
+  // Allocate a block at the end of the file without locking it, for nodes
+  // nobody else can reach yet.
+  template <typename T>
+  T* AllocAtEnd();
+  void LoadFreeList();
+  void SaveFreeList();
 
-  constexpr size_t GetMinKeys() const;
-  constexpr size_t GetMaxKeys() const;
-
   template <typename T>
-  int UpperBound(T arr[], int n, const char* target) const;
+  int UpperBound(const T* node, std::string_view target) const;
+  template <typename T>
+  int LowerBound(const T* node, std::string_view target) const;
+
+  void Insert(std::string_view key, std::string_view value);
+  // Keep path_ for the next append if leaf_node is the rightmost leaf and
+  // path_ leads to it.
+  void RememberRightmost(const LeafNode* leaf_node);
+  bool Remove(std::string_view key);
+  // Steps of Remove() after leaf_node lost records, unmaps leaf_node.
+  void Rebalance(LeafNode* leaf_node, bool merge_first);
+  // ops are sorted by key and all route to leaf_node, unmaps leaf_node.
+  void ApplyToLeaf(LeafNode* leaf_node,
+                   std::span<const WriteBatch::Op* const> ops);
+  template <typename F>
+  bool Find(std::string_view key, F read) const;
+  void Commit(uint64_t lsn);
+  void Checkpoint(bool closing);
+  // Same, the caller holds checkpoint_mutex_ exclusively. Write back before
+  // returning if wait.
+  void CheckpointLocked(bool closing, bool wait);
+  // Copy a block aside before it changes for the snapshots that still see it
+  // as it is, the caller holds its lock.
+  void Preserve(off_t offset, const void* block, size_t size);
+
+  // Move the node at offset on path_ to a lower free block, see Compact().
+  // Set *next to the first key of its right sibling, return false if it has
+  // none.
   template <typename T>
-  int LowerBound(T arr[], int n, const char* target) const;
-
-  off_t GetLeafOffset(const char* key) const;
-  LeafNode* SplitLeafNode(LeafNode* leaf_node);
-  IndexNode* SplitIndexNode(IndexNode* index_node);
-  size_t InsertKeyIntoIndexNode(IndexNode* index_node, const char* key,
-                                Node* left_node, Node* right_node);
-  size_t InsertKVIntoLeafNode(LeafNode* leaf_node, const char* key,
-                              const char* value);
-  int GetIndexFromLeafNode(LeafNode* leaf_node, const char* key) const;
+  bool Relocate(off_t offset, std::string* next);
+
+  void SetRoot(off_t root, size_t height);
+  // Parent of a node on path_, 0 for the root.
+  off_t Parent(const Node* node) const;
+  LeafNode* FindLeaf(std::string_view key, bool dirty,
+                     uint64_t* version) const;
+  LeafNode* LockLeaf(std::string_view key);
+  // Descend to the leaf for key and record the path in path_. Set *upper to
+  // the separator above the leaf, empty for the last leaf.
+  off_t GetLeafOffset(std::string_view key, std::string* upper = nullptr);
+  // With append, key goes after every key of the rightmost node of its level
+  // and the node is split unevenly.
+  LeafNode* SplitLeafNode(LeafNode* leaf_node, bool append);
+  IndexNode* SplitIndexNode(IndexNode* index_node, std::string* mid_key,
+                            bool append);
+  void InsertKeyIntoIndexNode(IndexNode* index_node, std::string_view key,
+                              Node* left_node, Node* right_node);
+  void InsertKeyIntoParent(Node* left_node, std::string_view key,
+                           Node* right_node);
+  int GetIndexFromLeafNode(const LeafNode* leaf_node,
+                           std::string_view key) const;
+  int GetIndexFromIndexNode(IndexNode* index_node, off_t of_child) const;
   IndexNode* GetOrCreateParent(Node* node);
 
   bool BorrowFromLeftLeafSibling(LeafNode* leaf_node);
@@ -77,18 +401,180 @@ class BPlusTree {
   bool BorrowFromLeafSibling(LeafNode* leaf_node);
   bool MergeLeftLeaf(LeafNode* leaf_node);
   bool MergeRightLeaf(LeafNode* leaf_node);
-  LeafNode* MergeLeaf(LeafNode* leaf_node);
+  bool MergeLeaf(LeafNode* leaf_node);
 
   bool BorrowFromLeftIndexSibling(IndexNode* index_node);
   bool BorrowFromRightIndexSibling(IndexNode* index_node);
   bool BorrowFromIndexSibling(IndexNode* index_node);
   bool MergeLeftIndex(IndexNode* index_node);
   bool MergeRightIndex(IndexNode* index_node);
-  IndexNode* MergeIndex(IndexNode* index_node);
+  bool MergeIndex(IndexNode* index_node);
 
   int fd_;
+  Tracer* tracer_;  // nullptr unless built with BPLUS_TREE_TRACE
   BlockCache* block_cache_;
+  Wal* wal_;
+  size_t checkpoint_size_;
   Meta* meta_;
+  // Offsets of recycled blocks, one set per size class(LeafNode, IndexNode).
+  std::set<off_t> free_blocks_[2];
+
+  // Readers validate node versions instead of locking. Writers lock the leaf
+  // they change, structure changes are serialized and lock every node they
+  // map, see Map().
+  std::atomic<uint64_t> root_seq_;  // odd while root and height change
+  // The rightmost leaf, writers try it before descending since appends of
+  // ascending keys all go there. 0 once it is deallocated.
+  std::atomic<off_t> last_leaf_;
+  mutable std::mutex smo_mutex_;
+  std::vector<Node*> smo_locked_;
+  // Offsets of the nodes from the leaf a structure change starts at up to the
+  // root, indexed by level. Nodes do not store their parent, so splits and
+  // merges only touch the nodes on this path and their siblings.
+  std::vector<off_t> path_;
+  // path_ leads to the rightmost leaf since the last structure change, so the
+  // next one that splits it need not descend. Guarded by smo_mutex_.
+  bool rightmost_path_;
+  // Where the next Compact() goes on, guarded by smo_mutex_.
+  size_t compact_level_;
+  std::string compact_key_;
+  // Statistics by level, guarded by smo_mutex_.
+  std::vector<uint64_t> splits_;
+  std::vector<uint64_t> merges_;
+  std::vector<uint64_t> borrows_;
+  // Shared by writers, exclusive for checkpoints and to take snapshots.
+  std::shared_mutex checkpoint_mutex_;
+  // Live snapshots, oldest first, only changed under checkpoint_mutex_
+  // exclusively.
+  std::vector<Snapshot*> snapshots_;
+};
+
+// Byte encodings of keys whose byte order is the key order: integers are
+// stored big-endian with the sign bit flipped, strings as they are.
+template <typename T, typename Enable = void>
+struct KeyCodec;
+
+template <typename T>
+struct KeyCodec<T, std::enable_if_t<std::is_integral_v<T> &&
+                                    !std::is_same_v<T, bool>>> {
+  using Buffer = char[sizeof(T)];
+  using Unsigned = std::make_unsigned_t<T>;
+  static constexpr Unsigned kSignBit =
+      std::is_signed_v<T> ? Unsigned(1) << (8 * sizeof(T) - 1) : 0;
+
+  static std::string_view Encode(T key, Buffer& buf) {
+    Unsigned u = static_cast<Unsigned>(key) ^ kSignBit;
+    for (size_t i = sizeof(T); i-- > 0; u >>= 8) buf[i] = char(u);
+    return std::string_view(buf, sizeof(T));
+  }
+
+  static T Decode(std::string_view bytes) {
+    Unsigned u = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) u = u << 8 | uint8_t(bytes[i]);
+    return static_cast<T>(u ^ kSignBit);
+  }
+};
+
+template <>
+struct KeyCodec<std::string> {
+  struct Buffer {};
+  static std::string_view Encode(const std::string& key, Buffer&) {
+    return key;
+  }
+  static std::string Decode(std::string_view bytes) {
+    return std::string(bytes);
+  }
+};
+
+// Byte encodings of values: trivially copyable values are stored raw, strings
+// as they are.
+template <typename T, typename Enable = void>
+struct ValueCodec;
+
+template <typename T>
+struct ValueCodec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+  static constexpr bool kFixedSize = true;
+  struct Buffer {};
+  static std::string_view Encode(const T& value, Buffer&) {
+    return std::string_view(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+  static T Decode(std::string_view bytes) {
+    T value;
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return value;
+  }
+};
+
+template <>
+struct ValueCodec<std::string> {
+  static constexpr bool kFixedSize = false;
+  struct Buffer {};
+  static std::string_view Encode(const std::string& value, Buffer&) {
+    return value;
+  }
+  static std::string Decode(std::string_view bytes) {
+    return std::string(bytes);
+  }
+};
+
+// A BPlusTree of typed keys and values, encoded on the stack by the codecs so
+// that the hot path builds no strings. Small fixed-size records pack densely
+// into the byte-sized slotted nodes, e.g. a uint64_t key with a 16-byte value
+// takes 36 bytes of a leaf, slot included.
+template <typename K, typename V, typename KC = KeyCodec<K>,
+          typename VC = ValueCodec<V>>
+class TypedBPlusTree {
+ public:
+  explicit TypedBPlusTree(
+      const char* path,
+      const BPlusTree::Options& options = BPlusTree::Options())
+      : tree_(path, options) {}
+
+  bool Put(const K& key, const V& value) {
+    typename KC::Buffer key_buf;
+    typename VC::Buffer value_buf;
+    return tree_.Put(KC::Encode(key, key_buf), VC::Encode(value, value_buf));
+  }
+
+  bool Delete(const K& key) {
+    typename KC::Buffer key_buf;
+    return tree_.Delete(KC::Encode(key, key_buf));
+  }
+
+  bool Get(const K& key, V* value) const {
+    typename KC::Buffer key_buf;
+    std::string_view k = KC::Encode(key, key_buf);
+    if constexpr (VC::kFixedSize) {
+      return tree_.Get(k, value, sizeof(V));
+    } else {
+      std::string bytes;
+      if (!tree_.Get(k, bytes)) return false;
+      *value = VC::Decode(bytes);
+      return true;
+    }
+  }
+
+  // Records with left <= key <= right in key order.
+  std::vector<std::pair<K, V>> GetRange(const K& left, const K& right) const {
+    typename KC::Buffer left_buf, right_buf;
+    std::string_view l = KC::Encode(left, left_buf);
+    std::string_view r = KC::Encode(right, right_buf);
+    std::vector<std::pair<K, V>> res;
+    BPlusTree::Cursor cursor(tree_);
+    for (cursor.Seek(l); cursor.Valid() && cursor.Key() <= r; cursor.Next()) {
+      res.emplace_back(KC::Decode(cursor.Key()), VC::Decode(cursor.Value()));
+    }
+    return res;
+  }
+
+  bool Empty() const { return tree_.Empty(); }
+  size_t Size() const { return tree_.Size(); }
+
+  // The underlying tree, e.g. for a Cursor or BulkLoad of encoded records.
+  BPlusTree& Tree() { return tree_; }
+
+ private:
+  BPlusTree tree_;
 };
 
 #endif  // BPLUS_TREE_H
\ No newline at end of file
@@ -1,14 +1,553 @@
+#include <sys/stat.h>
+
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "bplus_tree.h"
 
+// Run fn(thread, i) for i in [0, n) split over threads and return the
+// throughput in ops per second.
+template <typename F>
+long long RunThreads(int threads, int n, F fn) {
+  auto t1 = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([=] {
+      for (int i = 0; i < n / threads; ++i) fn(t, i);
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  auto t2 = std::chrono::steady_clock::now();
+  auto us =
+      std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+  return n * 1000000LL / std::max<long long>(us, 1);
+}
+
+// Every thread puts, gets and scans its own key range, so the threads only
+// share the upper levels of the tree.
+void ThreadsBenchmark(BPlusTree& bpt) {
+  const int n = 1000000;
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    auto key = [=](int t, int i) {
+      // Scatter i over [0, n).
+      char k[33];
+      snprintf(k, 33, "%d_%d_k%d", threads, t, int(i * 2654435761ULL % n));
+      return std::string(k);
+    };
+    auto put = RunThreads(threads, n, [&](int t, int i) {
+      char v[101];
+      snprintf(v, 101, "v%d", i);
+      bpt.Put(key(t, i), v);
+    });
+    auto get = RunThreads(threads, n, [&](int t, int i) {
+      std::string value;
+      bpt.Get(key(t, i), value);
+    });
+    auto range = RunThreads(threads, n / 10, [&](int t, int i) {
+      bpt.GetRange(key(t, i), key(t, i) + "~");
+    });
+    std::cout << threads << " threads: Put " << put << " ops/s, Get " << get
+              << " ops/s, GetRange " << range << " ops/s"
+              << "\n";
+  }
+}
+
+// Time point lookups of a small hot set before and after a scan of the whole
+// tree, which should not evict the blocks they need.
+void ScanBenchmark(BPlusTree& bpt) {
+  const int n = 1000000, hot = 100;
+  char k[33];
+  char v[101];
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "k%d", i);
+    snprintf(v, 101, "v%d", i);
+    bpt.Put(k, v);
+  }
+  auto get_hot = [&] {
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < hot; ++i) {
+      snprintf(k, 33, "k%d", i * (n / hot));
+      std::string value;
+      bpt.Get(k, value);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1)
+        .count();
+  };
+  for (int i = 0; i < 10; ++i) get_hot();
+  std::cout << "Get " << hot << " hot items before scan: " << get_hot()
+            << "us"
+            << "\n";
+  auto t1 = std::chrono::steady_clock::now();
+  size_t scanned = 0;
+  for (char c = '0'; c <= '9'; ++c) {
+    std::string left = std::string("k") + c;
+    scanned += bpt.GetRange(left, left + "~").size();
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  std::cout << "Scan " << scanned << " items: time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+                   .count()
+            << "ms"
+            << "\n";
+  std::cout << "Get " << hot << " hot items after scan: " << get_hot() << "us"
+            << "\n";
+}
+
+// Load sorted records bottom-up and scan them with GetRange and a cursor.
+void BulkLoadBenchmark(BPlusTree& bpt) {
+  const int n = 1000000;
+  char k[33];
+  char v[101];
+  int i = 0;
+  auto t1 = std::chrono::steady_clock::now();
+  bpt.BulkLoad([&](std::string* key, std::string* value) {
+    if (i == n) return false;
+    snprintf(k, 33, "k%08d", i);
+    snprintf(v, 101, "v%d", i);
+    ++i;
+    key->assign(k);
+    value->assign(v);
+    return true;
+  });
+  auto t2 = std::chrono::steady_clock::now();
+  std::cout << "BulkLoad " << n << " items: time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+                   .count()
+            << "ms"
+            << "\n";
+  size_t scanned = bpt.GetRange("k", "l").size();
+  auto t3 = std::chrono::steady_clock::now();
+  std::cout << "GetRange " << scanned << " items: time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t2)
+                   .count()
+            << "ms"
+            << "\n";
+
+  size_t bytes = 0;
+  scanned = 0;
+  BPlusTree::Cursor cursor(bpt);
+  for (cursor.SeekToFirst(); cursor.Valid(); cursor.Next()) {
+    bytes += cursor.Key().size() + cursor.Value().size();
+    ++scanned;
+  }
+  auto t4 = std::chrono::steady_clock::now();
+  std::cout << "Cursor scan " << scanned << " items(" << bytes
+            << " bytes): time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t4 - t3)
+                   .count()
+            << "ms"
+            << "\n";
+}
+
+// Scan a snapshot of 1M records while writers overwrite, delete and insert
+// records, the scan should see every record as it was.
+void SnapshotBenchmark(BPlusTree& bpt) {
+  const int n = 1000000, writers = 4;
+  char k[33];
+  char v[101];
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "k%08d", i);
+    snprintf(v, 101, "v%d", i);
+    bpt.Put(k, v);
+  }
+  auto snapshot = bpt.GetSnapshot();
+  std::atomic<bool> done(false);
+  std::atomic<long long> writes(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < writers; ++t) {
+    threads.emplace_back([&, t] {
+      char wk[33];
+      for (int i = t; !done; i += writers) {
+        snprintf(wk, 33, "k%08d", int(i * 2654435761ULL % n));
+        if (i % 3 == 0) {
+          bpt.Delete(wk);
+        } else {
+          if (i % 3 == 2) strcat(wk, "_new");
+          bpt.Put(wk, "changed");
+        }
+        ++writes;
+      }
+    });
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  size_t scanned = 0, wrong = 0;
+  BPlusTree::Cursor cursor(bpt, snapshot);
+  for (cursor.SeekToFirst(); cursor.Valid(); cursor.Next()) {
+    snprintf(k, 33, "k%08d", int(scanned));
+    snprintf(v, 101, "v%d", int(scanned));
+    if (cursor.Key() != k || cursor.Value() != v) ++wrong;
+    ++scanned;
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  done = true;
+  for (auto& thread : threads) thread.join();
+  auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+  std::cout << "Snapshot scan " << scanned << " items(" << wrong
+            << " wrong): time span=" << ms << "ms, " << writes
+            << " concurrent writes"
+            << "\n";
+}
+
+// Delete most of 1M records, then compact the tree in small steps while
+// another thread keeps reading and writing, and check what is left.
+void CompactBenchmark(BPlusTree& bpt) {
+  const int n = 1000000;
+  char k[33];
+  char v[101];
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "k%08d", i);
+    snprintf(v, 101, "v%d", i);
+    bpt.Put(k, v);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (i % 10 == 0) continue;
+    snprintf(k, 33, "k%08d", int(i * 2654435761ULL % n));
+    bpt.Delete(k);
+  }
+  auto file_size = [] {
+    struct stat st;
+    stat("test.db", &st);
+    return st.st_size / 1024;
+  };
+  std::cout << "File size after deleting 90% of " << n
+            << " items: " << file_size() << "KB"
+            << "\n";
+
+  std::atomic<bool> done(false);
+  std::thread worker([&] {
+    char wk[33];
+    std::string value;
+    for (int i = 0; !done; ++i) {
+      snprintf(wk, 33, "w%08d", i % 1000);
+      bpt.Put(wk, "x");
+      snprintf(wk, 33, "k%08d", int(i * 2654435761ULL % n));
+      bpt.Get(wk, value);
+    }
+  });
+  auto t1 = std::chrono::steady_clock::now();
+  int steps = 1;
+  while (!bpt.Compact()) ++steps;
+  auto t2 = std::chrono::steady_clock::now();
+  done = true;
+  worker.join();
+
+  // 1 in 10 records is left, those moved by Compact() keep their values.
+  size_t scanned = 0, wrong = 0;
+  BPlusTree::Cursor cursor(bpt);
+  for (cursor.Seek("k"); cursor.Valid() && cursor.Key() < "l"; cursor.Next()) {
+    ++scanned;
+    std::string key(cursor.Key());
+    snprintf(v, 101, "v%d", atoi(key.c_str() + 1));
+    if (cursor.Value() != v) ++wrong;
+  }
+  std::cout << "Compact in " << steps << " steps: time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+                   .count()
+            << "ms, file size " << file_size() << "KB, " << scanned
+            << " items left(" << wrong << " wrong)"
+            << "\n";
+}
+
+// Look up batches of 200 random keys, half of them missing, with Get one by
+// one and with MultiGet.
+void MultiGetBenchmark(BPlusTree& bpt) {
+  const int n = 1000000, batch = 200, batches = 5000;
+  char k[33];
+  if (bpt.Empty()) {
+    int i = 0;
+    bpt.BulkLoad([&](std::string* key, std::string* value) {
+      if (i == n) return false;
+      snprintf(k, 33, "k%08d", i);
+      key->assign(k);
+      value->assign("v" + std::to_string(i++));
+      return true;
+    });
+  }
+  std::vector<std::string> keys(batches * batch);
+  for (std::string& key : keys) {
+    snprintf(k, 33, "k%08d", rand() % (2 * n));
+    key = k;
+  }
+  std::vector<std::string_view> views(keys.begin(), keys.end());
+  auto ms = [](auto t1, auto t2) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+        .count();
+  };
+
+  auto t1 = std::chrono::steady_clock::now();
+  std::vector<std::string> values(keys.size());
+  std::vector<bool> found(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) found[i] = bpt.Get(keys[i], values[i]);
+  auto t2 = std::chrono::steady_clock::now();
+  size_t mismatches = 0;
+  for (int b = 0; b < batches; ++b) {
+    std::span<const std::string_view> batch_keys(&views[b * batch], batch);
+    std::vector<std::optional<std::string>> batch_values =
+        bpt.MultiGet(batch_keys);
+    for (int i = 0; i < batch; ++i) {
+      const std::optional<std::string>& value = batch_values[i];
+      if (value.has_value() != found[b * batch + i] ||
+          (value && *value != values[b * batch + i])) {
+        ++mismatches;
+      }
+    }
+  }
+  auto t3 = std::chrono::steady_clock::now();
+  std::cout << "Get " << keys.size() << " items: time span=" << ms(t1, t2)
+            << "ms, MultiGet in batches of " << batch
+            << ": time span=" << ms(t2, t3) << "ms, " << mismatches
+            << " mismatches"
+            << "\n";
+}
+
+// Put 1M random records one by one, then 1M others with Apply in batches of
+// 10K, and read both back.
+void BatchBenchmark(BPlusTree& bpt) {
+  const int n = 1000000, batch = 10000;
+  char k[33];
+  std::vector<int> keys(2 * n);
+  for (int i = 0; i < 2 * n; ++i) keys[i] = rand();
+  auto ms = [](auto t1, auto t2) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+        .count();
+  };
+
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "p%010d", keys[i]);
+    bpt.Put(k, std::to_string(keys[i]));
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  BPlusTree::WriteBatch write_batch;
+  for (int i = n; i < 2 * n; ++i) {
+    snprintf(k, 33, "b%010d", keys[i]);
+    write_batch.Put(k, std::to_string(keys[i]));
+    if (write_batch.Count() == batch) {
+      bpt.Apply(write_batch);
+      write_batch.Clear();
+    }
+  }
+  auto t3 = std::chrono::steady_clock::now();
+  size_t mismatches = 0;
+  std::string value;
+  for (int i = 0; i < 2 * n; ++i) {
+    snprintf(k, 33, "%c%010d", i < n ? 'p' : 'b', keys[i]);
+    if (!bpt.Get(k, value) || value != std::to_string(keys[i])) ++mismatches;
+  }
+  std::cout << "Put " << n << " items: time span=" << ms(t1, t2)
+            << "ms, Apply in batches of " << batch
+            << ": time span=" << ms(t2, t3) << "ms, " << mismatches
+            << " mismatches"
+            << "\n";
+}
+
+// Put 1M ascending keys, as time-ordered ids come in, and report how full
+// the leaves they leave behind are.
+void SequentialBenchmark(BPlusTree& bpt) {
+  const int n = 1000000;
+  char k[33];
+  std::string value(100, 'v');
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "s%010d", i);
+    bpt.Put(k, value);
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  BPlusTree::Statistics stats = bpt.Stats();
+  std::cout << "Put " << n << " ascending items: time span="
+            << std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+                   .count()
+            << "ms, leaf fill=" << stats.leaf_fill
+            << ", file bytes=" << stats.file_bytes << "\n";
+}
+
+// Put and get 1M random uint64_t keys with 16-byte values through the typed
+// tree, and the same keys as decimal strings through the plain one.
+void TypedBenchmark(const BPlusTree::Options& options) {
+  struct Value {
+    uint64_t a, b;
+  };
+  const int n = 1000000;
+  auto key = [](int i) {
+    return i * 2654435761ULL % n * 0x9E3779B97F4A7C15ULL;
+  };
+  auto ms = [](auto t1, auto t2) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1)
+        .count();
+  };
+
+  TypedBPlusTree<uint64_t, Value> typed("typed.db", options);
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) typed.Put(key(i), Value{key(i), uint64_t(i)});
+  auto t2 = std::chrono::steady_clock::now();
+  Value value;
+  for (int i = 0; i < n; ++i) typed.Get(key(i), &value);
+  auto t3 = std::chrono::steady_clock::now();
+  std::cout << "Typed Put " << n << " items: time span=" << ms(t1, t2)
+            << "ms, Get: time span=" << ms(t2, t3) << "ms"
+            << "\n";
+
+  BPlusTree strings("test.db", options);
+  char k[33];
+  t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "%llu", (unsigned long long)key(i));
+    strings.Put(k, "v123456789abcdef");
+  }
+  t2 = std::chrono::steady_clock::now();
+  std::string v;
+  for (int i = 0; i < n; ++i) {
+    snprintf(k, 33, "%llu", (unsigned long long)key(i));
+    strings.Get(k, v);
+  }
+  t3 = std::chrono::steady_clock::now();
+  std::cout << "String Put " << n << " items: time span=" << ms(t1, t2)
+            << "ms, Get: time span=" << ms(t2, t3) << "ms"
+            << "\n";
+}
+
+void PrintStats(const BPlusTree& bpt) {
+  BPlusTree::Statistics stats = bpt.Stats();
+  auto levels = [](const std::vector<uint64_t>& counts) {
+    std::string s;
+    for (uint64_t count : counts) s += " " + std::to_string(count);
+    return s.empty() ? std::string(" 0") : s;
+  };
+  std::cout << "Cache: " << stats.cache_hits << " hits, " << stats.cache_misses
+            << " misses, " << stats.evictions << " evictions, "
+            << stats.cached_bytes / 1024 << "KB cached, "
+            << stats.mapped_bytes / 1024 << "KB mapped"
+            << "\n";
+  std::cout << "File: " << stats.mmaps << " mmaps, " << stats.munmaps
+            << " munmaps, " << stats.ftruncates << " ftruncates, "
+            << stats.hole_punches << " hole punches, " << stats.reads
+            << " reads, " << stats.writes << " writes, "
+            << stats.file_bytes / 1024 << "KB"
+            << "\n";
+  std::cout << "Tree: height " << stats.height << ", " << stats.size
+            << " items, " << stats.leaf_blocks << "+" << stats.free_leaf_blocks
+            << " free leaves, " << stats.index_blocks << "+"
+            << stats.free_index_blocks << " free index nodes, leaf fill "
+            << stats.leaf_fill << "\n";
+  std::cout << "Splits by level:" << levels(stats.splits)
+            << ", merges:" << levels(stats.merges)
+            << ", borrows:" << levels(stats.borrows) << "\n";
+
+  // Only built with make TRACE=1.
+  const char* phases[] = {"Get",         "Put",   "Delete", "Descend",
+                          "SMO",         "Split", "Load",   "Evict",
+                          "Commit",      "Checkpoint"};
+  for (int i = 0; i < static_cast<int>(BPlusTree::Phase::kPhaseCount); ++i) {
+    BPlusTree::Histogram latency =
+        bpt.Latency(static_cast<BPlusTree::Phase>(i));
+    if (latency.count == 0) continue;
+    std::cout << phases[i] << ": " << latency.count << " samples, p50 "
+              << latency.Percentile(0.5) << "ns, p99 "
+              << latency.Percentile(0.99) << "ns, p999 "
+              << latency.Percentile(0.999) << "ns, max " << latency.max
+              << "ns"
+              << "\n";
+  }
+  const char* types[] = {"split", "merge", "borrow", "root", "relocate"};
+  std::vector<BPlusTree::TraceEvent> events = bpt.TraceEvents();
+  size_t first = events.size() > 5 ? events.size() - 5 : 0;
+  for (size_t i = first; i < events.size(); ++i) {
+    std::cout << "  " << events[i].time_ns << " " << types[events[i].type]
+              << " level " << events[i].level << " at " << events[i].offset
+              << "\n";
+  }
+}
+
 int main(int argc, char const* argv[]) {
-  (void)argc;
-  (void)argv;
+  BPlusTree::Options options;
+  bool threads = false, scan = false, bulk = false, typed = false,
+       snapshot = false, compact = false, stats = false, multiget = false,
+       batch = false, sequential = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "arena") == 0) {
+      options.storage_mode = BPlusTree::StorageMode::kArena;
+    } else if (strcmp(argv[i], "buffered") == 0) {
+      options.storage_mode = BPlusTree::StorageMode::kBuffered;
+    } else if (strcmp(argv[i], "io_uring") == 0) {
+      options.storage_mode = BPlusTree::StorageMode::kBuffered;
+      options.use_io_uring = true;
+    } else if (strcmp(argv[i], "wal") == 0) {
+      options.use_wal = true;
+      options.sync_policy = BPlusTree::SyncPolicy::kInterval;
+    } else if (strcmp(argv[i], "sparse") == 0) {
+      options.sparse_leaves = true;
+    } else if (strcmp(argv[i], "compress") == 0) {
+      options.storage_mode = BPlusTree::StorageMode::kBuffered;
+      options.compress_leaves = true;
+    } else if (strcmp(argv[i], "lru") == 0) {
+      options.cache_policy = BPlusTree::CachePolicy::kLru;
+    } else if (strcmp(argv[i], "threads") == 0) {
+      threads = true;
+    } else if (strcmp(argv[i], "scan") == 0) {
+      scan = true;
+    } else if (strcmp(argv[i], "bulk") == 0) {
+      bulk = true;
+    } else if (strcmp(argv[i], "typed") == 0) {
+      typed = true;
+    } else if (strcmp(argv[i], "snapshot") == 0) {
+      snapshot = true;
+    } else if (strcmp(argv[i], "compact") == 0) {
+      compact = true;
+    } else if (strcmp(argv[i], "stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "multiget") == 0) {
+      multiget = true;
+    } else if (strcmp(argv[i], "batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "sequential") == 0) {
+      sequential = true;
+    }
+  }
 
   srand(time(0));
-  BPlusTree bpt("test.db");
+  if (typed) {
+    TypedBenchmark(options);
+    return 0;
+  }
+  BPlusTree bpt("test.db", options);
+  if (threads) {
+    ThreadsBenchmark(bpt);
+    return 0;
+  }
+  if (scan) {
+    ScanBenchmark(bpt);
+    return 0;
+  }
+  if (bulk) {
+    BulkLoadBenchmark(bpt);
+    return 0;
+  }
+  if (snapshot) {
+    SnapshotBenchmark(bpt);
+    return 0;
+  }
+  if (compact) {
+    CompactBenchmark(bpt);
+    return 0;
+  }
+  if (multiget) {
+    MultiGetBenchmark(bpt);
+    return 0;
+  }
+  if (batch) {
+    BatchBenchmark(bpt);
+    return 0;
+  }
+  if (sequential) {
+    SequentialBenchmark(bpt);
+    return 0;
+  }
   char k[33];
   char v[101];
   for (int n = 10000; n <= 1000000; n *= 10) {
@@ -55,6 +594,13 @@ int main(int argc, char const* argv[]) {
                      .count()
               << "ms"
               << "\n";
+
+    struct stat st;
+    stat("test.db", &st);
+    std::cout << "File size " << st.st_size / 1024 << "KB, on disk "
+              << st.st_blocks * 512 / 1024 << "KB"
+              << "\n";
+    if (stats) PrintStats(bpt);
   }
   return 0;
 }